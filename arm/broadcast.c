@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Measure what it costs to run a function on all CPUs with on_cpus()
+ *
+ * The caller either starts every other CPU itself, which is what on_cpus()
+ * used to do, or hands the function down a tree of the given fanout, see
+ * lib/on-cpus.c. A broadcast only ends once all CPUs have run the function,
+ * so the numbers include the completion barrier. Each CPU counts its calls,
+ * which checks that every broadcast reached every CPU exactly once.
+ *
+ * Usage: broadcast [fanout=<N>]
+ *   fanout  only measure this fanout, default: flat, 2, 4, 8 and 16
+ */
+#include <libcflat.h>
+#include <bench.h>
+#include <on-cpus.h>
+#include <util.h>
+#include <asm/barrier.h>
+#include <asm/processor.h>
+#include <asm/smp.h>
+
+/* One cache line each, to not measure false sharing */
+static struct {
+	unsigned long n;
+} __attribute__((aligned(64))) calls[NR_CPUS];
+static unsigned long broadcasts;
+static long only_fanout;
+
+static uint64_t cntvct_read(void)
+{
+	isb();
+	return get_cntvct();
+}
+
+static struct bench_clock clock = {
+	.unit = "ticks",
+	.read = cntvct_read,
+};
+
+static void count_call(void *data)
+{
+	calls[smp_processor_id()].n++;
+}
+
+static void broadcast_run(struct bench *bench, unsigned long iters)
+{
+	int fanout = (long)bench->data;
+
+	while (iters--) {
+		on_cpus_fanout(count_call, NULL, fanout);
+		broadcasts++;
+	}
+}
+
+static void broadcast_test(const struct bench_params *params, int fanout)
+{
+	char name[32];
+	struct bench bench = {
+		.name = name,
+		.run = broadcast_run,
+		.data = (void *)(long)fanout,
+	};
+	bool once = true;
+	int cpu;
+
+	if (fanout >= nr_cpus - 1)
+		snprintf(name, sizeof(name), "flat");
+	else
+		snprintf(name, sizeof(name), "tree, fanout %d", fanout);
+
+	memset(calls, 0, sizeof(calls));
+	broadcasts = 0;
+	smp_wmb();
+
+	bench_run(&clock, params, &bench);
+
+	smp_rmb();
+	for_each_present_cpu(cpu) {
+		if (calls[cpu].n != broadcasts) {
+			report_info("cpu%d: %lu calls for %lu broadcasts",
+				    cpu, calls[cpu].n, broadcasts);
+			once = false;
+		}
+	}
+	report(once, "%s: every CPU ran every broadcast once", name);
+}
+
+static void parse_args(int argc, char **argv)
+{
+	long val;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (parse_keyval(argv[i], &val) < 0 ||
+		    strncmp(argv[i], "fanout=", 7))
+			report_abort("unknown argument %s", argv[i]);
+		if (val <= 0)
+			report_abort("invalid fanout %ld", val);
+		only_fanout = val;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const int fanouts[] = { 2, 4, 8, 16 };
+	struct bench_params params = BENCH_PARAMS_DEFAULT;
+	int i;
+
+	report_prefix_push("broadcast");
+	parse_args(argc, argv);
+
+	if (nr_cpus < 2) {
+		report_skip("need at least 2 cpus");
+		goto out;
+	}
+
+	clock.freq = get_cntfrq();
+	params.reps = 16;
+	params.target = clock.freq / 100;
+
+	report_info("%d vcpus", nr_cpus);
+	bench_print_header(&clock);
+
+	if (only_fanout) {
+		broadcast_test(&params, only_fanout);
+		goto out;
+	}
+
+	broadcast_test(&params, nr_cpus - 1);
+	for (i = 0; i < ARRAY_SIZE(fanouts); i++) {
+		if (fanouts[i] < nr_cpus - 1)
+			broadcast_test(&params, fanouts[i]);
+	}
+
+out:
+	report_prefix_pop();
+	return report_summary();
+}
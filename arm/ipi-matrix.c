@@ -0,0 +1,387 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Measure IPI latency between every pair of vCPUs, and IPI throughput with
+ * all of them sending to each other
+ *
+ * micro-bench's ipi test only measures CPU 0 to CPU 1, which hides what
+ * crossing SMT siblings, cores and NUMA nodes on the host costs. Here, for
+ * every sender/receiver pair in turn, the sender flags a request and sends
+ * an SGI to the receiver, idling in WFI, whose handler timestamps it and
+ * sends an SGI back:
+ *   + one-way latency is the receiver's timestamp minus the sender's, the
+ *     virtual counter being the same on all vCPUs,
+ *   + the round trip lasts until the sender has taken the reply.
+ * Then all vCPUs ping each other round-robin at once, which gives the
+ * aggregate throughput and the round trip of every pair under load.
+ * Latencies are printed as sender x receiver matrices.
+ *
+ * Usage: ipi-matrix [iters=<N>] [rounds=<N>] [cpus=<N>]
+ *   iters   round trips per pair, the median is reported, default 256
+ *   rounds  all-to-all round trips from each vCPU to each other one,
+ *           default 64
+ *   cpus    only use the first N vCPUs, default all
+ */
+#include <libcflat.h>
+#include <alloc.h>
+#include <bench.h>
+#include <bitops.h>
+#include <util.h>
+#include <asm/barrier.h>
+#include <asm/gic.h>
+#include <asm/processor.h>
+#include <asm/smp.h>
+
+#define IPI_SGI		1
+
+enum cmd {
+	CMD_NONE,
+	CMD_PING,	/* ping ->target iters times */
+	CMD_FLOOD,	/* ping everyone, rounds times */
+	CMD_EXIT,
+};
+
+struct pcpu {
+	int cmd;
+	int target;
+	/* Set by the receiver of our ping, which then sends us an SGI. */
+	uint64_t stamp;
+	int acked;
+	/* Set by our own handler once it has seen acked. */
+	int done;
+} __attribute__((aligned(64)));
+
+static struct pcpu pcpus[NR_CPUS];
+static int nr_test_cpus, workers_ready;
+/* nr_test_cpus rows of pending requests, one bit per sender */
+static unsigned long *requests;
+static int nr_words;
+
+static long iters = 256, rounds = 64;
+static uint64_t *rtt_samples, *one_way_samples;
+static unsigned long skewed;
+
+/* Per sender row, only written by the sender. */
+static uint64_t *flood_ticks, *flood_count;
+static int flood_ready, flood_go;
+
+static uint64_t cntvct_read(void)
+{
+	isb();
+	return get_cntvct();
+}
+
+static struct bench_clock clock = {
+	.unit = "ticks",
+	.read = cntvct_read,
+};
+
+static void irq_handler(struct pt_regs *regs)
+{
+	uint64_t now = cntvct_read();
+	u32 irqstat = gic_read_iar();
+	int me = smp_processor_id();
+	unsigned long *req = &requests[me * nr_words], bits;
+	int w, sender;
+
+	if (gic_iar_irqnr(irqstat) == GICC_INT_SPURIOUS)
+		return;
+	gic_write_eoir(irqstat);
+
+	for (w = 0; w < nr_words; w++) {
+		bits = __sync_fetch_and_and(&req[w], 0);
+		while (bits) {
+			sender = w * BITS_PER_LONG + __builtin_ctzl(bits);
+			bits &= bits - 1;
+			pcpus[sender].stamp = now;
+			smp_wmb();
+			WRITE_ONCE(pcpus[sender].acked, 1);
+			gic_ipi_send_single(IPI_SGI, sender);
+		}
+	}
+
+	if (READ_ONCE(pcpus[me].acked)) {
+		pcpus[me].acked = 0;
+		WRITE_ONCE(pcpus[me].done, 1);
+	}
+}
+
+/* Returns the round trip; interrupts must be enabled. */
+static uint64_t ping(int me, int target, uint64_t *one_way)
+{
+	struct pcpu *p = &pcpus[me];
+	unsigned long tries = 1ul << 30;
+	uint64_t start, end;
+
+	p->done = 0;
+	start = cntvct_read();
+	__sync_fetch_and_or(&requests[target * nr_words + BIT_WORD(me)], BIT_MASK(me));
+	gic_ipi_send_single(IPI_SGI, target);
+	while (!READ_ONCE(p->done) && --tries)
+		cpu_relax();
+	end = cntvct_read();
+	assert_msg(tries, "cpu%d: no reply from cpu%d", me, target);
+
+	if (one_way) {
+		smp_rmb();
+		if ((int64_t)(p->stamp - start) < 0) {
+			skewed++;
+			*one_way = 0;
+		} else {
+			*one_way = p->stamp - start;
+		}
+	}
+	return end - start;
+}
+
+static void do_ping(int me)
+{
+	int target = pcpus[me].target;
+	long i;
+
+	for (i = 0; i < iters; i++)
+		rtt_samples[i] = ping(me, target, &one_way_samples[i]);
+}
+
+static void do_flood(int me)
+{
+	uint64_t *ticks = &flood_ticks[me * nr_test_cpus];
+	uint64_t *count = &flood_count[me * nr_test_cpus];
+	int target, r, k;
+
+	__sync_fetch_and_add(&flood_ready, 1);
+	while (!READ_ONCE(flood_go))
+		cpu_relax();
+
+	for (r = 0; r < rounds; r++) {
+		for (k = 1; k < nr_test_cpus; k++) {
+			target = (me + k) % nr_test_cpus;
+			ticks[target] += ping(me, target, NULL);
+			count[target]++;
+		}
+	}
+}
+
+/*
+ * Idle until @cpu has nothing to do, so that we can take SGIs meanwhile.
+ * WFI wakes up for a pending interrupt even while it's masked.
+ */
+static void wait_cmd_done(int cpu)
+{
+	local_irq_disable();
+	while (READ_ONCE(pcpus[cpu].cmd) != CMD_NONE) {
+		wfi();
+		local_irq_enable();
+		local_irq_disable();
+	}
+	local_irq_enable();
+}
+
+static void setup_irq(void)
+{
+#ifdef __arm__
+	install_exception_handler(EXCPTN_IRQ, irq_handler);
+#else
+	install_irq_handler(EL1H_IRQ, irq_handler);
+#endif
+	gic_enable_defaults();
+}
+
+static void worker(void *data)
+{
+	int me = smp_processor_id();
+	struct pcpu *p = &pcpus[me];
+	int cmd;
+
+	setup_irq();
+	__sync_fetch_and_add(&workers_ready, 1);
+
+	for (;;) {
+		local_irq_disable();
+		while ((cmd = READ_ONCE(p->cmd)) == CMD_NONE) {
+			wfi();
+			local_irq_enable();
+			local_irq_disable();
+		}
+		local_irq_enable();
+
+		if (cmd == CMD_EXIT)
+			break;
+		if (cmd == CMD_PING)
+			do_ping(me);
+		else
+			do_flood(me);
+
+		smp_wmb();
+		WRITE_ONCE(p->cmd, CMD_NONE);
+		gic_ipi_send_single(IPI_SGI, 0);
+	}
+
+	WRITE_ONCE(p->cmd, CMD_NONE);
+	gic_ipi_send_single(IPI_SGI, 0);
+	local_irq_disable();
+}
+
+static void post_cmd(int cpu, int cmd)
+{
+	WRITE_ONCE(pcpus[cpu].cmd, cmd);
+	gic_ipi_send_single(IPI_SGI, cpu);
+}
+
+static void measure_pairs(void)
+{
+	int n = nr_test_cpus;
+	uint64_t *rtt = calloc(n * n, sizeof(*rtt));
+	uint64_t *one_way = calloc(n * n, sizeof(*one_way));
+	struct bench_stats stats;
+	int s, r;
+	long i;
+
+	assert(rtt && one_way);
+
+	for (s = 0; s < n; s++) {
+		for (r = 0; r < n; r++) {
+			if (s == r) {
+				rtt[s * n + r] = one_way[s * n + r] = BENCH_NONE;
+				continue;
+			}
+
+			pcpus[s].target = r;
+			if (s == 0) {
+				do_ping(s);
+			} else {
+				post_cmd(s, CMD_PING);
+				wait_cmd_done(s);
+			}
+			smp_rmb();
+
+			for (i = 0; i < iters; i++) {
+				rtt_samples[i] = bench_scale(&clock, rtt_samples[i], 1);
+				one_way_samples[i] = bench_scale(&clock, one_way_samples[i], 1);
+			}
+			bench_reduce(rtt_samples, iters, false, &stats);
+			rtt[s * n + r] = stats.median;
+			bench_reduce(one_way_samples, iters, false, &stats);
+			one_way[s * n + r] = stats.median;
+		}
+	}
+
+	bench_matrix_print(&clock, "one-way latency, median", one_way, n);
+	bench_matrix_print(&clock, "round trip, median", rtt, n);
+	if (skewed)
+		report_info("%lu one-way samples went back in time", skewed);
+
+	free(rtt);
+	free(one_way);
+}
+
+static void measure_flood(void)
+{
+	int n = nr_test_cpus;
+	uint64_t *rtt = calloc(n * n, sizeof(*rtt));
+	uint64_t start, ticks, total = 0;
+	int cpu, i;
+
+	assert(rtt);
+
+	for (cpu = 1; cpu < n; cpu++)
+		post_cmd(cpu, CMD_FLOOD);
+	while (READ_ONCE(flood_ready) < n - 1)
+		cpu_relax();
+
+	start = cntvct_read();
+	WRITE_ONCE(flood_go, 1);
+	do_flood(0);
+	for (cpu = 1; cpu < n; cpu++)
+		wait_cmd_done(cpu);
+	ticks = cntvct_read() - start;
+	smp_rmb();
+
+	for (i = 0; i < n * n; i++) {
+		total += flood_count[i];
+		rtt[i] = flood_count[i] ?
+			 bench_scale(&clock, flood_ticks[i], flood_count[i]) : BENCH_NONE;
+	}
+
+	bench_matrix_print(&clock, "round trip under all-to-all load, mean", rtt, n);
+	printf("all-to-all: %" PRIu64 " round trips in %" PRIu64 " us, %" PRIu64
+	       " per second\n", total, ticks * 1000000 / clock.freq,
+	       ticks ? total * clock.freq / ticks : 0);
+	report(total == (uint64_t)n * (n - 1) * rounds,
+	       "all-to-all: every vCPU pinged every other one %ld times", rounds);
+
+	free(rtt);
+}
+
+static void parse_args(int argc, char **argv)
+{
+	long val;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (parse_keyval(argv[i], &val) < 0)
+			report_abort("unknown argument %s", argv[i]);
+
+		if (!strncmp(argv[i], "iters=", 6))
+			iters = val;
+		else if (!strncmp(argv[i], "rounds=", 7))
+			rounds = val;
+		else if (!strncmp(argv[i], "cpus=", 5))
+			nr_test_cpus = MIN(val, nr_test_cpus);
+		else
+			report_abort("unknown argument %s", argv[i]);
+	}
+
+	if (iters <= 0 || rounds <= 0 || nr_test_cpus <= 0)
+		report_abort("invalid arguments");
+}
+
+int main(int argc, char **argv)
+{
+	int n, cpu;
+
+	report_prefix_push("ipi-matrix");
+	nr_test_cpus = nr_cpus;
+	parse_args(argc, argv);
+	n = nr_test_cpus;
+
+	if (n < 2) {
+		report_skip("need at least 2 cpus");
+		goto out;
+	}
+
+	if (!gic_init()) {
+		report_skip("no supported gic");
+		goto out;
+	}
+
+	clock.freq = get_cntfrq();
+	nr_words = (n + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	requests = calloc(n * nr_words, sizeof(*requests));
+	rtt_samples = malloc(iters * sizeof(*rtt_samples));
+	one_way_samples = malloc(iters * sizeof(*one_way_samples));
+	flood_ticks = calloc(n * n, sizeof(*flood_ticks));
+	flood_count = calloc(n * n, sizeof(*flood_count));
+	assert(requests && rtt_samples && one_way_samples &&
+	       flood_ticks && flood_count);
+
+	setup_irq();
+	for (cpu = 1; cpu < n; cpu++)
+		on_cpu_async(cpu, worker, NULL);
+	while (READ_ONCE(workers_ready) < n - 1)
+		cpu_relax();
+	local_irq_enable();
+
+	report_info("%d vcpus, %ld round trips per pair", n, iters);
+	measure_pairs();
+	measure_flood();
+
+	for (cpu = 1; cpu < n; cpu++) {
+		post_cmd(cpu, CMD_EXIT);
+		wait_cmd_done(cpu);
+	}
+	local_irq_disable();
+
+out:
+	report_prefix_pop();
+	return report_summary();
+}
@@ -19,9 +19,13 @@
  * This work is licensed under the terms of the GNU LGPL, version 2.
  */
 #include <libcflat.h>
+#include <bench.h>
 #include <util.h>
 #include <asm/gic.h>
 #include <asm/gic-v3-its.h>
+#include <asm/pmu.h>
+#include <asm/smp.h>
+#include <asm/spinlock.h>
 #include <asm/timer.h>
 
 #define QEMU_MMIO_ADDR		0x0a000008
@@ -29,17 +33,61 @@
 static u32 cntfrq;
 
 static volatile bool irq_ready, irq_received;
+static volatile bool irq_received_cpu[NR_CPUS];
+/* Run the tests that support it on all vCPUs at once. */
+static bool parallel;
 static int nr_ipi_received;
 static unsigned long mmio_addr = QEMU_MMIO_ADDR;
 
 static void *vgic_dist_base;
 static void (*write_eoir)(u32 irqstat);
 
+static uint64_t cntvct_read(void)
+{
+	uint64_t t;
+
+	dsb(ish);
+	isb();
+	t = read_sysreg(cntvct_el0);
+	isb();
+	return t;
+}
+
+static struct bench_clock cntvct_clock = {
+	.unit = "ticks",
+	.read = cntvct_read,
+};
+
+/*
+ * The PMU cycle counter resolves a single exit at cycle granularity,
+ * unlike the generic timer which may tick at only tens of MHz. Note that
+ * with a virtual PMU it only counts while the vCPU runs guest code.
+ */
+static uint64_t pmccntr_read(void)
+{
+	uint64_t t;
+
+	isb();
+	t = get_pmccntr();
+	isb();
+	return t;
+}
+
+static struct bench_clock pmccntr_clock = {
+	.unit = "cycles",
+	.read = pmccntr_read,
+};
+
+static struct bench_clock *clock = &cntvct_clock;
+/* Also time every single iteration into a histogram. */
+static bool sample;
+
 static void gic_irq_handler(struct pt_regs *regs)
 {
 	u32 irqstat = gic_read_iar();
 	irq_ready = false;
 	irq_received = true;
+	irq_received_cpu[smp_processor_id()] = true;
 	gic_write_eoir(irqstat);
 
 	if (irqstat == TIMER_VTIMER_IRQ) {
@@ -69,7 +117,7 @@ static bool test_init(void)
 		return false;
 	}
 
-	if (nr_cpus < 2) {
+	if (!parallel && nr_cpus < 2) {
 		printf("At least two cpus required, skipping tests...\n");
 		return false;
 	}
@@ -87,11 +135,34 @@ static bool test_init(void)
 
 	irq_ready = false;
 	gic_enable_defaults();
-	on_cpu_async(1, gic_secondary_entry, NULL);
+	/* In parallel mode all CPUs run the tests, none is left to idle */
+	if (!parallel)
+		on_cpu_async(1, gic_secondary_entry, NULL);
 
 	cntfrq = get_cntfrq();
-	printf("Timer Frequency %d Hz (Output in microseconds)\n", cntfrq);
+	cntvct_clock.freq = cntfrq;
+	printf("Timer Frequency %d Hz\n", cntfrq);
+
+	if (clock == &pmccntr_clock) {
+		u8 ver = get_pmu_version();
+
+		if (ver == ID_DFR0_PMU_NOTIMPL || ver == ID_DFR0_PMU_IMPDEF) {
+			printf("No PMU cycle counter, using the generic timer\n");
+			clock = &cntvct_clock;
+		} else {
+			/*
+			 * PMCCFILTR is 0, so cycles spent in EL2 aren't
+			 * counted: under KVM the host's share of an exit
+			 * doesn't show up in the results.
+			 */
+			pmu_cycle_counter_start();
+			printf("Timing with the PMU cycle counter (Output in cycles, "
+			       "guest side only: EL2/host time isn't counted)\n");
+			return true;
+		}
+	}
 
+	printf("Timing with the generic timer (Output in nanoseconds)\n");
 	return true;
 }
 
@@ -167,11 +238,71 @@ static void ipi_exec(void)
 	assert_msg(irq_received, "failed to receive IPI in time, but received %d successfully\n", nr_ipi_received);
 }
 
+/*
+ * In parallel mode every CPU triggers an LPI targeting itself: device 3,
+ * event <cpu> -> LPI 8200 + <cpu>, collection <cpu> -> PE <cpu>. The ITS
+ * command queue is shared, so the senders serialize on a lock.
+ */
+#define LPI_PARALLEL_DEVID	3
+#define LPI_PARALLEL_INTID	8200
+
+static struct spinlock its_cmd_lock;
+
+static bool lpi_parallel_prep(void)
+{
+	struct its_collection *col;
+	struct its_device *dev;
+	int cpu;
+
+	if (!gicv3_its_base())
+		return false;
+
+	if (nr_cpus > GITS_MAX_COLLECTIONS) {
+		printf("lpi: at most %d cpus supported in parallel mode\n",
+		       GITS_MAX_COLLECTIONS);
+		return false;
+	}
+
+	its_enable_defaults();
+	dev = its_create_device(LPI_PARALLEL_DEVID, GITS_MAX_COLLECTIONS);
+	its_send_mapd_nv(dev, true);
+
+	for_each_present_cpu(cpu) {
+		col = its_create_collection(cpu, cpu);
+		gicv3_lpi_set_config(LPI_PARALLEL_INTID + cpu, LPI_PROP_DEFAULT);
+		its_send_mapc_nv(col, true);
+		its_send_invall_nv(col);
+		its_send_mapti_nv(dev, LPI_PARALLEL_INTID + cpu, cpu, col);
+	}
+
+	return true;
+}
+
+static void lpi_parallel_exec(void)
+{
+	int cpu = smp_processor_id();
+	unsigned tries = 1 << 28;
+
+	irq_received_cpu[cpu] = false;
+
+	spin_lock(&its_cmd_lock);
+	its_send_int_nv(its_get_device(LPI_PARALLEL_DEVID), cpu);
+	spin_unlock(&its_cmd_lock);
+
+	while (!irq_received_cpu[cpu] && tries--)
+		cpu_relax();
+
+	assert_msg(irq_received_cpu[cpu], "CPU%d failed to receive LPI in time", cpu);
+}
+
 static bool lpi_prep(void)
 {
 	struct its_collection *col1;
 	struct its_device *dev2;
 
+	if (parallel)
+		return lpi_parallel_prep();
+
 	if (!gicv3_its_base())
 		return false;
 
@@ -195,6 +326,11 @@ static void lpi_exec(void)
 	unsigned tries = 1 << 28;
 	static int received = 0;
 
+	if (parallel) {
+		lpi_parallel_exec();
+		return;
+	}
+
 	irq_received = false;
 
 	dev2 = its_get_device(2);
@@ -247,14 +383,14 @@ static void timer_exec(void)
 	assert_msg(irq_received, "failed to receive PPI in time, but received %d successfully\n", received);
 }
 
-static void timer_post(uint64_t ntimes, uint64_t *total_ticks)
+static uint64_t timer_overhead(void)
 {
 	/*
 	 * We use a 10msec timer to test the latency of PPI,
 	 * so we subtract the ticks of 10msec to get the
 	 * actual latency
 	 */
-	*total_ticks -= ntimes * (cntfrq / 100);
+	return cntfrq / 100;
 }
 
 static void hvc_exec(void)
@@ -300,77 +436,188 @@ struct exit_test {
 	const char *name;
 	bool (*prep)(void);
 	void (*exec)(void);
-	void (*post)(uint64_t ntimes, uint64_t *total_ticks);
+	/* ticks per iteration that are not part of the measurement */
+	uint64_t (*overhead)(void);
 	u32 times;
 	bool run;
+	bool parallel;	/* can run on all CPUs concurrently */
 };
 
 static struct exit_test tests[] = {
-	{"hvc",			NULL,			hvc_exec,		NULL,		65536,		true},
-	{"mmio_read_user",	mmio_read_user_prep,	mmio_read_user_exec,	NULL,		65536,		true},
-	{"mmio_read_vgic",	NULL,			mmio_read_vgic_exec,	NULL,		65536,		true},
-	{"eoi",			NULL,			eoi_exec,		NULL,		65536,		true},
-	{"ipi",			ipi_prep,		ipi_exec,		NULL,		65536,		true},
-	{"ipi_hw",		ipi_hw_prep,		ipi_exec,		NULL,		65536,		true},
-	{"lpi",			lpi_prep,		lpi_exec,		NULL,		65536,		true},
-	{"timer_10ms",		timer_prep,		timer_exec,		timer_post,	256,		true},
+	{"hvc",			NULL,			hvc_exec,		NULL,		65536,		true,	true},
+	{"mmio_read_user",	mmio_read_user_prep,	mmio_read_user_exec,	NULL,		65536,		true,	true},
+	{"mmio_read_vgic",	NULL,			mmio_read_vgic_exec,	NULL,		65536,		true,	true},
+	{"eoi",			NULL,			eoi_exec,		NULL,		65536,		true,	true},
+	{"ipi",			ipi_prep,		ipi_exec,		NULL,		65536,		true,	false},
+	{"ipi_hw",		ipi_hw_prep,		ipi_exec,		NULL,		65536,		true,	false},
+	{"lpi",			lpi_prep,		lpi_exec,		NULL,		65536,		true,	true},
+	{"timer_10ms",		timer_prep,		timer_exec,		timer_overhead,	256,		true,	false},
 };
 
-struct ns_time {
-	uint64_t ns;
-	uint64_t ns_frac;
+#define PS_PER_SEC	(1000 * 1000 * 1000 * 1000UL)
+
+/* Each test runs its 'times' iterations split over this many samples. */
+#define NR_SAMPLES	16
+
+static const struct bench_params params = {
+	.warmup = 1,
+	.reps = NR_SAMPLES,
 };
 
-#define PS_PER_SEC (1000 * 1000 * 1000 * 1000UL)
-static void ticks_to_ns_time(uint64_t ticks, struct ns_time *ns_time)
+static bool loop_prep(struct bench *bench)
+{
+	struct exit_test *test = bench->data;
+
+	if (test->overhead && clock != &cntvct_clock) {
+		printf("%s: overhead is only known in timer ticks\n", test->name);
+		return false;
+	}
+	if (test->prep && !test->prep())
+		return false;
+	if (test->overhead)
+		bench->overhead = test->overhead();
+	return true;
+}
+
+static void loop_run(struct bench *bench, unsigned long iters)
 {
-	uint64_t ps_per_tick = PS_PER_SEC / cntfrq + !!(PS_PER_SEC % cntfrq);
-	uint64_t ps;
+	struct exit_test *test = bench->data;
 
-	ps = ticks * ps_per_tick;
-	ns_time->ns = ps / 1000;
-	ns_time->ns_frac = (ps % 1000) / 100;
+	while (iters--)
+		test->exec();
 }
 
-static void loop_test(struct exit_test *test)
+static struct bench_hist hist;
+static uint64_t clock_overhead;
+
+static void measure_clock_overhead(void)
 {
-	uint64_t start, end, total_ticks, ntimes = 0;
-	struct ns_time avg_ns, total_ns = {};
-
-	total_ticks = 0;
-	if (test->prep) {
-		if(!test->prep()) {
-			printf("%s test skipped\n", test->name);
-			return;
-		}
+	uint64_t t1, t2;
+	int i;
+
+	clock_overhead = ~0ull;
+	for (i = 0; i < 1000; ++i) {
+		t1 = clock->read();
+		t2 = clock->read();
+		clock_overhead = MIN(clock_overhead, t2 - t1);
 	}
+	printf("Sampling every iteration in %s, clock read overhead %" PRIu64 "\n",
+	       clock->unit, clock_overhead);
+}
 
-	dsb(ish);
-	isb();
-	start = read_sysreg(cntvct_el0);
-	isb();
-	while (ntimes < test->times) {
+static void sample_test(struct exit_test *test)
+{
+	uint64_t t1, t2, overhead = clock_overhead;
+	u32 i;
+
+	if (test->overhead)
+		overhead += test->overhead();
+
+	bench_hist_init(&hist);
+	for (i = 0; i < test->times; i++) {
+		t1 = clock->read();
 		test->exec();
+		t2 = clock->read() - t1;
+		bench_hist_add(&hist, t2 > overhead ? t2 - overhead : 0);
+	}
+	bench_hist_print(test->name, &hist);
+}
 
-		ntimes++;
+static void loop_test(struct exit_test *test)
+{
+	struct bench bench = {
+		.name = test->name,
+		.prep = loop_prep,
+		.run = loop_run,
+		.data = test,
+		.iters = MAX(test->times / NR_SAMPLES, 1),
+	};
+	struct bench_stats stats;
+
+	if (!bench_measure(clock, &params, &bench, &stats)) {
+		printf("%s test skipped\n", test->name);
+		return;
 	}
-	dsb(ish);
-	isb();
-	end = read_sysreg(cntvct_el0);
 
-	total_ticks = end - start;
-	ticks_to_ns_time(total_ticks, &total_ns);
+	bench_print(test->name, &stats);
+	if (sample)
+		sample_test(test);
+}
+
+static cpumask_t ready;
+static uint64_t cpu_samples[NR_CPUS][NR_SAMPLES];
+static struct bench_stats cpu_stats[NR_CPUS];
+
+static void parallel_cpu_init(void *data)
+{
+	if (clock == &pmccntr_clock)
+		pmu_cycle_counter_start();
+	install_irq_handler(EL1H_IRQ, gic_irq_handler);
+	gic_enable_defaults();
+	local_irq_enable();
+}
+
+static void parallel_worker(void *data)
+{
+	struct exit_test *test = data;
+	int cpu = smp_processor_id();
+	struct bench bench = {
+		.name = test->name,
+		.run = loop_run,
+		.data = test,
+		.iters = MAX(test->times / NR_SAMPLES, 1),
+		.samples = cpu_samples[cpu],
+	};
+
+	/* start all CPUs together so that they really contend */
+	cpumask_set_cpu(cpu, &ready);
+	while (!cpumask_full(&ready))
+		cpu_relax();
+
+	bench_measure(clock, &params, &bench, &cpu_stats[cpu]);
+}
 
-	if (test->post) {
-		test->post(ntimes, &total_ticks);
-		ticks_to_ns_time(total_ticks, &total_ns);
+/*
+ * Run @test on all CPUs at once and print the per-CPU results, the
+ * distribution over all samples of all CPUs, and the aggregate number
+ * of operations per second, or per million cycles with the PMU cycle
+ * counter, completed by all CPUs together.
+ */
+static void parallel_test(struct exit_test *test)
+{
+	static uint64_t all[NR_CPUS * NR_SAMPLES];
+	struct bench_stats stats;
+	uint64_t ops = 0;
+	char name[64];
+	int cpu, nr = 0;
+
+	if (test->prep && !test->prep()) {
+		printf("%s test skipped\n", test->name);
+		return;
 	}
 
-	avg_ns.ns = total_ns.ns / ntimes;
-	avg_ns.ns_frac = total_ns.ns_frac / ntimes;
+	cpumask_clear(&ready);
+	on_cpus(parallel_worker, test);
+
+	for_each_present_cpu(cpu) {
+		snprintf(name, sizeof(name), "%s/cpu%d", test->name, cpu);
+		bench_print(name, &cpu_stats[cpu]);
+		memcpy(&all[nr], cpu_samples[cpu], sizeof(cpu_samples[cpu]));
+		nr += NR_SAMPLES;
+		/* ps with a known frequency, else ticks * BENCH_SCALE */
+		if (!cpu_stats[cpu].median)
+			continue;
+		if (clock->freq)
+			ops += PS_PER_SEC / cpu_stats[cpu].median;
+		else
+			ops += BENCH_SCALE * 1000000ull / cpu_stats[cpu].median;
+	}
 
-	printf("%-30s%15" PRId64 ".%-15" PRId64 "%15" PRId64 ".%-15" PRId64 "\n",
-		test->name, total_ns.ns, total_ns.ns_frac, avg_ns.ns, avg_ns.ns_frac);
+	bench_reduce(all, nr, params.keep_outliers, &stats);
+	snprintf(name, sizeof(name), "%s/all", test->name);
+	bench_print(name, &stats);
+	printf("  aggregate %s cpus %d ops per %s %" PRIu64 "\n", test->name,
+	       nr_cpus, clock->freq ? "second" : "Mcycle", ops);
 }
 
 static void parse_args(int argc, char **argv)
@@ -379,6 +626,22 @@ static void parse_args(int argc, char **argv)
 	long val;
 
 	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "parallel") == 0) {
+			parallel = true;
+			report_info("running on all %d cpus", nr_cpus);
+			continue;
+		}
+
+		if (strcmp(argv[i], "pmccntr") == 0) {
+			clock = &pmccntr_clock;
+			continue;
+		}
+
+		if (strcmp(argv[i], "sample") == 0) {
+			sample = true;
+			continue;
+		}
+
 		len = parse_keyval(argv[i], &val);
 		if (len == -1)
 			continue;
@@ -399,15 +662,24 @@ int main(int argc, char **argv)
 	if (!test_init())
 		return 1;
 
-	printf("\n%-30s%18s%13s%18s%13s\n", "name", "total ns", "", "avg ns", "");
-	for (i = 0 ; i < 92; ++i)
-		printf("%c", '-');
+	if (parallel) {
+		for_each_present_cpu(i)
+			on_cpu(i, parallel_cpu_init, NULL);
+	}
+
+	if (sample)
+		measure_clock_overhead();
+
 	printf("\n");
+	bench_print_header(clock);
 	for (i = 0; i < ARRAY_SIZE(tests); i++) {
-		if (!tests[i].run)
+		if (!tests[i].run || (parallel && !tests[i].parallel))
 			continue;
 		assert(tests[i].name && tests[i].exec);
-		loop_test(&tests[i]);
+		if (parallel)
+			parallel_test(&tests[i]);
+		else
+			loop_test(&tests[i]);
 	}
 
 	return 0;
@@ -0,0 +1,255 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Measure what live migration costs a guest that keeps dirtying memory
+ *
+ * All secondary vCPUs dirty a working set at a controlled rate while the
+ * primary one has the VM migrated. Every page write is timestamped with
+ * the virtual counter, which gives, from inside the guest:
+ *   + the longest stall between two writes, i.e. the downtime as far as
+ *     the guest can tell,
+ *   + the distribution of write latencies before, during and after
+ *     migration, which exposes the cost of dirty tracking (write
+ *     protection faults, dirty ring or PML exits),
+ *   + the dirty rate actually achieved.
+ * Every page is checked for its last written value after the migrations.
+ *
+ * The virtual counter only shows the downtime if QEMU doesn't hide it from
+ * the guest, e.g. with -cpu host,kvm-no-adjvtime=on.
+ *
+ * Usage: migration-dirty [wss=<MB>] [rate=<MB/s>] [migrations=<N>]
+ *                        [period=<ms>] [max_stall=<ms>]
+ *   wss        working set shared by the secondary vCPUs, default 32
+ *   rate       target dirty rate of all of them, default 0 (unlimited)
+ *   migrations number of migrations, default 1
+ *   period     time spent dirtying before and after migrating, default 1000
+ *   max_stall  fail if the longest stall during migration is longer
+ */
+#include <libcflat.h>
+#include <alloc.h>
+#include <bench.h>
+#include <cpumask.h>
+#include <migrate.h>
+#include <util.h>
+#include <asm/barrier.h>
+#include <asm/delay.h>
+#include <asm/page.h>
+#include <asm/processor.h>
+#include <asm/smp.h>
+
+enum phase {
+	BEFORE,
+	DURING,
+	AFTER,
+	NR_PHASES
+};
+
+static const char * const phase_names[NR_PHASES] = {
+	"before", "during", "after",
+};
+
+struct dirtier {
+	char *mem;
+	unsigned long nr_pages;
+	uint64_t seq;				/* pages written so far */
+	uint64_t writes[NR_PHASES];
+	uint64_t max_stall[NR_PHASES];		/* ticks */
+	struct bench_hist hist[NR_PHASES];	/* ns per write */
+};
+
+static struct dirtier *dirtiers;
+static uint64_t ticks_per_page;		/* 0: unlimited */
+static uint64_t freq;
+static int phase;
+static bool stop;
+static cpumask_t done;
+
+static long wss_mb = 32, rate_mb, migrations = 1, period_ms = 1000, max_stall_ms;
+
+static uint64_t ticks_to_ns(uint64_t ticks)
+{
+	return ticks / freq * 1000000000ull + ticks % freq * 1000000000ull / freq;
+}
+
+static uint64_t *page_word(struct dirtier *d, unsigned long page)
+{
+	return (uint64_t *)(d->mem + page * PAGE_SIZE);
+}
+
+static void dirty(void *data)
+{
+	struct dirtier *d = &dirtiers[smp_processor_id()];
+	uint64_t start, prev, now, gap;
+	int p;
+
+	start = prev = get_cntvct();
+	while (!READ_ONCE(stop)) {
+		p = READ_ONCE(phase);
+		if (!ticks_per_page || d->seq * ticks_per_page <= prev - start) {
+			WRITE_ONCE(*page_word(d, d->seq % d->nr_pages), d->seq);
+			d->seq++;
+			d->writes[p]++;
+			now = get_cntvct();
+			bench_hist_add(&d->hist[p], ticks_to_ns(now - prev));
+		} else {
+			now = get_cntvct();
+		}
+
+		gap = now - prev;
+		if (gap > d->max_stall[p])
+			d->max_stall[p] = gap;
+		prev = now;
+	}
+
+	smp_wmb();
+	cpumask_set_cpu(smp_processor_id(), &done);
+}
+
+/* Each page holds the last sequence number written to it, or ~0. */
+static bool verify(struct dirtier *d)
+{
+	uint64_t expected;
+	unsigned long i;
+
+	for (i = 0; i < d->nr_pages; i++) {
+		if (d->seq > i)
+			expected = i + (d->seq - 1 - i) / d->nr_pages * d->nr_pages;
+		else
+			expected = ~0ull;
+
+		if (*page_word(d, i) != expected) {
+			report_info("cpu%d page %lu: expected %" PRIu64 ", got %" PRIu64,
+				    (int)(d - dirtiers), i, expected, *page_word(d, i));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void parse_args(int argc, char **argv)
+{
+	long val;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (parse_keyval(argv[i], &val) < 0)
+			report_abort("unknown argument %s", argv[i]);
+
+		if (!strncmp(argv[i], "wss=", 4))
+			wss_mb = val;
+		else if (!strncmp(argv[i], "rate=", 5))
+			rate_mb = val;
+		else if (!strncmp(argv[i], "migrations=", 11))
+			migrations = val;
+		else if (!strncmp(argv[i], "period=", 7))
+			period_ms = val;
+		else if (!strncmp(argv[i], "max_stall=", 10))
+			max_stall_ms = val;
+		else
+			report_abort("unknown argument %s", argv[i]);
+	}
+
+	if (wss_mb <= 0 || rate_mb < 0 || migrations <= 0 || period_ms < 0)
+		report_abort("invalid arguments");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long pages_per_cpu, i;
+	int nr_dirtiers = nr_cpus - 1;
+	uint64_t t[NR_PHASES + 1], stall_ns = 0;
+	struct bench_hist *hist;
+	bool intact = true;
+	int cpu, p;
+
+	report_prefix_push("migration-dirty");
+	parse_args(argc, argv);
+
+	if (nr_dirtiers < 1) {
+		report_skip("need at least 2 cpus");
+		migrate_once();
+		goto out;
+	}
+
+	freq = get_cntfrq();
+	pages_per_cpu = MAX((wss_mb << 20) / PAGE_SIZE / nr_dirtiers, 1);
+	if (rate_mb)
+		ticks_per_page = freq * PAGE_SIZE * nr_dirtiers /
+				 ((uint64_t)rate_mb << 20) ? : 1;
+
+	dirtiers = calloc(nr_cpus, sizeof(*dirtiers));
+	hist = malloc(sizeof(*hist));
+	assert(dirtiers && hist);
+	for (cpu = 1; cpu < nr_cpus; cpu++) {
+		struct dirtier *d = &dirtiers[cpu];
+
+		d->nr_pages = pages_per_cpu;
+		d->mem = memalign(PAGE_SIZE, pages_per_cpu * PAGE_SIZE);
+		assert(d->mem);
+		for (i = 0; i < pages_per_cpu; i++)
+			*page_word(d, i) = ~0ull;
+		for (p = 0; p < NR_PHASES; p++)
+			bench_hist_init(&d->hist[p]);
+	}
+
+	report_info("%d vcpus dirtying %ld MB at %s%ld MB/s, %ld migrations",
+		    nr_dirtiers, wss_mb, rate_mb ? "" : "up to ", rate_mb,
+		    migrations);
+
+	cpumask_set_cpu(0, &done);
+	for (cpu = 1; cpu < nr_cpus; cpu++)
+		on_cpu_async(cpu, dirty, NULL);
+
+	t[BEFORE] = get_cntvct();
+	mdelay(period_ms);
+
+	WRITE_ONCE(phase, DURING);
+	t[DURING] = get_cntvct();
+	for (i = 0; i < migrations; i++)
+		migrate();
+
+	WRITE_ONCE(phase, AFTER);
+	t[AFTER] = get_cntvct();
+	mdelay(period_ms);
+
+	WRITE_ONCE(stop, true);
+	t[NR_PHASES] = get_cntvct();
+	while (!cpumask_full(&done))
+		cpu_relax();
+	smp_rmb();
+
+	for (p = 0; p < NR_PHASES; p++) {
+		uint64_t writes = 0, stall = 0, ns;
+
+		bench_hist_init(hist);
+		for (cpu = 1; cpu < nr_cpus; cpu++) {
+			writes += dirtiers[cpu].writes[p];
+			stall = MAX(stall, dirtiers[cpu].max_stall[p]);
+			bench_hist_merge(hist, &dirtiers[cpu].hist[p]);
+		}
+
+		/* KB * 10^9 / ns = KB/s */
+		ns = ticks_to_ns(t[p + 1] - t[p]) ? : 1;
+		report_info("%s: %" PRIu64 " MB/s dirtied, longest stall %" PRIu64 " us",
+			    phase_names[p],
+			    (uint64_t)((writes * PAGE_SIZE >> 10) * 1000000000ull / ns >> 10),
+			    ticks_to_ns(stall) / 1000);
+		bench_hist_print(phase_names[p], hist);
+
+		if (p == DURING)
+			stall_ns = ticks_to_ns(stall);
+	}
+
+	for (cpu = 1; cpu < nr_cpus; cpu++)
+		intact &= verify(&dirtiers[cpu]);
+	report(intact, "dirtied memory intact after %ld migrations", migrations);
+
+	if (max_stall_ms)
+		report(stall_ns <= max_stall_ms * 1000000ull,
+		       "longest stall during migration %" PRIu64 " us <= %ld ms",
+		       stall_ns / 1000, max_stall_ms);
+
+out:
+	report_prefix_pop();
+	return report_summary();
+}
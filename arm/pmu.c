@@ -20,23 +20,7 @@
 #include "asm/processor.h"
 #include <bitops.h>
 #include <asm/gic.h>
-
-#define PMU_PMCR_E         (1 << 0)
-#define PMU_PMCR_P         (1 << 1)
-#define PMU_PMCR_C         (1 << 2)
-#define PMU_PMCR_D         (1 << 3)
-#define PMU_PMCR_X         (1 << 4)
-#define PMU_PMCR_DP        (1 << 5)
-#define PMU_PMCR_LC        (1 << 6)
-#define PMU_PMCR_LP        (1 << 7)
-#define PMU_PMCR_N_SHIFT   11
-#define PMU_PMCR_N_MASK    0x1f
-#define PMU_PMCR_ID_SHIFT  16
-#define PMU_PMCR_ID_MASK   0xff
-#define PMU_PMCR_IMP_SHIFT 24
-#define PMU_PMCR_IMP_MASK  0xff
-
-#define PMU_CYCLE_IDX      31
+#include <asm/pmu.h>
 
 #define NR_SAMPLES 10
 
@@ -98,57 +82,6 @@ struct pmu_stats {
 static struct pmu pmu;
 
 #if defined(__arm__)
-#define ID_DFR0_PERFMON_SHIFT 24
-#define ID_DFR0_PERFMON_MASK  0xf
-
-#define ID_DFR0_PMU_NOTIMPL	0b0000
-#define ID_DFR0_PMU_V1		0b0001
-#define ID_DFR0_PMU_V2		0b0010
-#define ID_DFR0_PMU_V3		0b0011
-#define ID_DFR0_PMU_V3_8_1	0b0100
-#define ID_DFR0_PMU_V3_8_4	0b0101
-#define ID_DFR0_PMU_V3_8_5	0b0110
-#define ID_DFR0_PMU_IMPDEF	0b1111
-
-#define PMCR         __ACCESS_CP15(c9, 0, c12, 0)
-#define ID_DFR0      __ACCESS_CP15(c0, 0, c1, 2)
-#define PMSELR       __ACCESS_CP15(c9, 0, c12, 5)
-#define PMXEVTYPER   __ACCESS_CP15(c9, 0, c13, 1)
-#define PMCNTENSET   __ACCESS_CP15(c9, 0, c12, 1)
-#define PMCNTENCLR   __ACCESS_CP15(c9, 0, c12, 2)
-#define PMOVSR       __ACCESS_CP15(c9, 0, c12, 3)
-#define PMCCNTR32    __ACCESS_CP15(c9, 0, c13, 0)
-#define PMINTENCLR   __ACCESS_CP15(c9, 0, c14, 2)
-#define PMCCNTR64    __ACCESS_CP15_64(0, c9)
-
-static inline uint32_t get_id_dfr0(void) { return read_sysreg(ID_DFR0); }
-static inline uint32_t get_pmcr(void) { return read_sysreg(PMCR); }
-static inline void set_pmcr(uint32_t v) { write_sysreg(v, PMCR); }
-static inline void set_pmcntenset(uint32_t v) { write_sysreg(v, PMCNTENSET); }
-
-static inline uint8_t get_pmu_version(void)
-{
-	return (get_id_dfr0() >> ID_DFR0_PERFMON_SHIFT) & ID_DFR0_PERFMON_MASK;
-}
-
-static inline uint64_t get_pmccntr(void)
-{
-	return read_sysreg(PMCCNTR32);
-}
-
-static inline void set_pmccntr(uint64_t value)
-{
-	write_sysreg(value & 0xffffffff, PMCCNTR32);
-}
-
-/* PMCCFILTR is an obsolete name for PMXEVTYPER31 in ARMv7 */
-static inline void set_pmccfiltr(uint32_t value)
-{
-	write_sysreg(PMU_CYCLE_IDX, PMSELR);
-	write_sysreg(value, PMXEVTYPER);
-	isb();
-}
-
 /*
  * Extra instructions inserted by the compiler would be difficult to compensate
  * for, so hand assemble everything between, and including, the PMCR accesses
@@ -196,30 +129,6 @@ static void test_chain_promotion(bool unused) {}
 static void test_overflow_interrupt(bool overflow_at_64bits) {}
 
 #elif defined(__aarch64__)
-#define ID_AA64DFR0_PERFMON_SHIFT 8
-#define ID_AA64DFR0_PERFMON_MASK  0xf
-
-#define ID_DFR0_PMU_NOTIMPL	0b0000
-#define ID_DFR0_PMU_V3		0b0001
-#define ID_DFR0_PMU_V3_8_1	0b0100
-#define ID_DFR0_PMU_V3_8_4	0b0101
-#define ID_DFR0_PMU_V3_8_5	0b0110
-#define ID_DFR0_PMU_IMPDEF	0b1111
-
-static inline uint32_t get_id_aa64dfr0(void) { return read_sysreg(id_aa64dfr0_el1); }
-static inline uint32_t get_pmcr(void) { return read_sysreg(pmcr_el0); }
-static inline void set_pmcr(uint32_t v) { write_sysreg(v, pmcr_el0); }
-static inline uint64_t get_pmccntr(void) { return read_sysreg(pmccntr_el0); }
-static inline void set_pmccntr(uint64_t v) { write_sysreg(v, pmccntr_el0); }
-static inline void set_pmcntenset(uint32_t v) { write_sysreg(v, pmcntenset_el0); }
-static inline void set_pmccfiltr(uint32_t v) { write_sysreg(v, pmccfiltr_el0); }
-
-static inline uint8_t get_pmu_version(void)
-{
-	uint8_t ver = (get_id_aa64dfr0() >> ID_AA64DFR0_PERFMON_SHIFT) & ID_AA64DFR0_PERFMON_MASK;
-	return ver;
-}
-
 /*
  * Extra instructions inserted by the compiler would be difficult to compensate
  * for, so hand assemble everything between, and including, the PMCR accesses
@@ -1062,11 +971,7 @@ static bool check_cycles_increase(void)
 
 	/* init before event access, this test only cares about cycle count */
 	pmu_reset();
-	set_pmcntenset(1 << PMU_CYCLE_IDX);
-	set_pmccfiltr(0); /* count cycles in EL0, EL1, but not EL2 */
-
-	set_pmcr(get_pmcr() | PMU_PMCR_LC | PMU_PMCR_C | PMU_PMCR_E);
-	isb();
+	pmu_cycle_counter_start();
 
 	for (int i = 0; i < NR_SAMPLES; i++) {
 		uint64_t a, b;
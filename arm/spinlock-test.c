@@ -3,6 +3,24 @@
  *
  * This code is based on code from the tcg_baremetal_tests.
  *
+ * With 'bench', compare lock algorithms instead: test-and-set, test and
+ * test-and-set, ticket, MCS and CLH queued locks, and the library's
+ * spin_lock(). For each of them and each vCPU count, all vCPUs take the
+ * lock in a loop for a while, which gives the throughput, the handoff
+ * latency from one vCPU releasing the lock to another one owning it, and
+ * the fairness as the fewest and most acquisitions of any vCPU. Waiting
+ * either spins with YIELD or, on arm64, sleeps in WFE until the lock word
+ * changes, which shows how each design copes with YIELD and WFx trapping.
+ *
+ * Usage: spinlock-test [bad]
+ *        spinlock-test bench [lock=<name>] [period=<ms>] [cs=<N>] [ncs=<N>]
+ *                            [wfe=<0|1>]
+ *   lock    only measure this one: tas, ttas, ticket, mcs, clh or lib
+ *   period  time each vCPU count is measured for, default 200
+ *   cs      iterations of work in the critical section, default 100
+ *   ncs     iterations of work outside of it, default 400
+ *   wfe     wait in WFE rather than spin, default 0
+ *
  * Copyright (C) 2015 Virtual Open Systems SAS
  *
  * This program is free software; you can redistribute it and/or modify
@@ -11,8 +29,13 @@
  */
 
 #include <libcflat.h>
+#include <alloc.h>
+#include <bench.h>
+#include <util.h>
 #include <asm/smp.h>
 #include <asm/barrier.h>
+#include <asm/processor.h>
+#include <asm/spinlock.h>
 
 #define LOOP_SIZE 10000000
 
@@ -70,9 +93,344 @@ static void test_spinlock(void *data __unused)
 	report(errors == 0, "CPU%d: Done - Errors: %d", cpu, errors);
 }
 
+static bool use_wfe;
+
+/* Wait until *@p isn't @old anymore. */
+static void wait_change(int *p, int old)
+{
+#ifdef __aarch64__
+	int val;
+
+	if (use_wfe) {
+		/*
+		 * The load arms the exclusive monitor, whose clearing by a
+		 * store from another CPU is an event that ends the WFE.
+		 */
+		asm volatile("sevl");
+		do {
+			asm volatile("wfe\n"
+				     "ldxr	%w0, [%1]"
+				     : "=&r" (val) : "r" (p) : "memory");
+		} while (val == old);
+		return;
+	}
+#endif
+	while (READ_ONCE(*p) == old)
+		cpu_relax();
+}
+
+static int tas_v;
+
+static void tas_lock(void)
+{
+	while (__sync_lock_test_and_set(&tas_v, 1))
+		;
+}
+
+static void tas_unlock(void)
+{
+	__sync_lock_release(&tas_v);
+}
+
+static void ttas_lock(void)
+{
+	for (;;) {
+		wait_change(&tas_v, 1);
+		if (!__sync_lock_test_and_set(&tas_v, 1))
+			return;
+	}
+}
+
+static struct {
+	int next;
+	int owner;
+} ticket;
+
+static void ticket_lock(void)
+{
+	int me = __sync_fetch_and_add(&ticket.next, 1);
+	int owner;
+
+	while ((owner = READ_ONCE(ticket.owner)) != me)
+		wait_change(&ticket.owner, owner);
+	smp_mb();
+}
+
+static void ticket_unlock(void)
+{
+	smp_mb();
+	WRITE_ONCE(ticket.owner, ticket.owner + 1);
+}
+
+struct qnode {
+	struct qnode *next;
+	int locked;
+} __attribute__((aligned(64)));
+
+static struct qnode mcs_nodes[NR_CPUS];
+static struct qnode *mcs_tail;
+
+static void mcs_lock(void)
+{
+	struct qnode *node = &mcs_nodes[smp_processor_id()], *prev;
+
+	node->next = NULL;
+	node->locked = 0;
+	prev = __atomic_exchange_n(&mcs_tail, node, __ATOMIC_ACQ_REL);
+	if (!prev)
+		return;
+
+	WRITE_ONCE(prev->next, node);
+	wait_change(&node->locked, 0);
+	smp_mb();
+}
+
+static void mcs_unlock(void)
+{
+	struct qnode *node = &mcs_nodes[smp_processor_id()], *next;
+
+	next = READ_ONCE(node->next);
+	if (!next) {
+		if (__sync_bool_compare_and_swap(&mcs_tail, node, NULL))
+			return;
+		while (!(next = READ_ONCE(node->next)))
+			cpu_relax();
+	}
+	smp_mb();
+	WRITE_ONCE(next->locked, 1);
+}
+
+/*
+ * CLH: each waiter spins on its predecessor's node, and takes it over as
+ * its own for the next acquisition. One node more than CPUs is needed,
+ * the one the lock starts out with.
+ */
+static struct qnode clh_nodes[NR_CPUS + 1];
+static struct qnode *clh_mine[NR_CPUS], *clh_pred[NR_CPUS];
+static struct qnode *clh_tail;
+
+static void clh_init(void)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < NR_CPUS; cpu++)
+		clh_mine[cpu] = &clh_nodes[cpu];
+	clh_nodes[NR_CPUS].locked = 0;
+	clh_tail = &clh_nodes[NR_CPUS];
+}
+
+static void clh_lock(void)
+{
+	int cpu = smp_processor_id();
+	struct qnode *node = clh_mine[cpu], *pred;
+
+	node->locked = 1;
+	pred = __atomic_exchange_n(&clh_tail, node, __ATOMIC_ACQ_REL);
+	wait_change(&pred->locked, 1);
+	smp_mb();
+	clh_pred[cpu] = pred;
+}
+
+static void clh_unlock(void)
+{
+	int cpu = smp_processor_id();
+
+	smp_mb();
+	WRITE_ONCE(clh_mine[cpu]->locked, 0);
+	clh_mine[cpu] = clh_pred[cpu];
+}
+
+static struct spinlock lib_spinlock;
+
+static void lib_lock(void)
+{
+	spin_lock(&lib_spinlock);
+}
+
+static void lib_unlock(void)
+{
+	spin_unlock(&lib_spinlock);
+}
+
+struct bench_lock {
+	const char *name;
+	void (*init)(void);
+	void (*lock)(void);
+	void (*unlock)(void);
+};
+
+static const struct bench_lock bench_locks[] = {
+	{ "tas",	NULL,		tas_lock,	tas_unlock },
+	{ "ttas",	NULL,		ttas_lock,	tas_unlock },
+	{ "ticket",	NULL,		ticket_lock,	ticket_unlock },
+	{ "mcs",	NULL,		mcs_lock,	mcs_unlock },
+	{ "clh",	clh_init,	clh_lock,	clh_unlock },
+	{ "lib",	NULL,		lib_lock,	lib_unlock },
+};
+
+struct bench_cpu {
+	unsigned long acquired;
+	struct bench_hist handoff;	/* ns */
+} __attribute__((aligned(64)));
+
+static const struct bench_lock *cur_lock;
+static struct bench_cpu *bench_cpus;
+static int nr_bench_cpus, nr_ready, nr_done, go;
+static uint64_t freq, end;
+static long period_ms = 200, cs_iters = 100, ncs_iters = 400;
+
+/* Only touched by the lock holder */
+static unsigned long protected_count;
+static uint64_t released;
+static int last_owner;
+
+static void work(long iters)
+{
+	volatile long i;
+
+	for (i = 0; i < iters; i++)
+		;
+}
+
+static void lock_bench(void *data)
+{
+	int cpu = smp_processor_id();
+	struct bench_cpu *bc = &bench_cpus[cpu];
+	uint64_t now;
+
+	if (cpu >= nr_bench_cpus)
+		return;
+
+	__sync_fetch_and_add(&nr_ready, 1);
+	while (!READ_ONCE(go))
+		cpu_relax();
+
+	do {
+		cur_lock->lock();
+		now = get_cntvct();
+		if (last_owner != cpu && released)
+			bench_hist_add(&bc->handoff, (now - released) * 1000000000ull / freq);
+		protected_count++;
+		work(cs_iters);
+		last_owner = cpu;
+		released = get_cntvct();
+		cur_lock->unlock();
+
+		bc->acquired++;
+		work(ncs_iters);
+	} while (now < end);
+
+	__sync_fetch_and_add(&nr_done, 1);
+}
+
+static void bench_one(const struct bench_lock *bl, int nr)
+{
+	unsigned long total = 0, min = ~0ul, max = 0;
+	struct bench_hist *handoff = malloc(sizeof(*handoff));
+	uint64_t start, ticks;
+	int cpu;
+
+	assert(handoff);
+	cur_lock = bl;
+	nr_bench_cpus = nr;
+	nr_ready = nr_done = go = 0;
+	protected_count = 0;
+	released = 0;
+	last_owner = -1;
+	if (bl->init)
+		bl->init();
+	memset(bench_cpus, 0, nr_cpus * sizeof(*bench_cpus));
+	for (cpu = 0; cpu < nr; cpu++)
+		bench_hist_init(&bench_cpus[cpu].handoff);
+	smp_wmb();
+
+	/* We join in last, once the others are waiting for go. */
+	for (cpu = 1; cpu < nr; cpu++)
+		on_cpu_async(cpu, lock_bench, NULL);
+	while (READ_ONCE(nr_ready) < nr - 1)
+		cpu_relax();
+	start = get_cntvct();
+	end = start + period_ms * freq / 1000;
+	smp_wmb();
+	WRITE_ONCE(go, 1);
+	lock_bench(NULL);
+	while (READ_ONCE(nr_done) < nr)
+		cpu_relax();
+	ticks = get_cntvct() - start;
+	smp_rmb();
+
+	bench_hist_init(handoff);
+	for (cpu = 0; cpu < nr; cpu++) {
+		total += bench_cpus[cpu].acquired;
+		min = MIN(min, bench_cpus[cpu].acquired);
+		max = MAX(max, bench_cpus[cpu].acquired);
+		bench_hist_merge(handoff, &bench_cpus[cpu].handoff);
+	}
+
+	printf("%-8s%6d%12lu%10" PRIu64 "%10" PRIu64 "%10lu%10lu\n",
+	       bl->name, nr, (unsigned long)(total * freq / 1000 / ticks),
+	       bench_hist_value_at(handoff, 500), bench_hist_value_at(handoff, 990),
+	       min, max);
+	report(protected_count == total, "%s: %d vcpus: mutual exclusion", bl->name, nr);
+	free(handoff);
+}
+
+static int lock_bench_main(int argc, char **argv)
+{
+	const char *only = NULL;
+	long val;
+	int i, nr;
+
+	report_prefix_push("bench");
+
+	for (i = 2; i < argc; i++) {
+		if (parse_keyval(argv[i], &val) < 0)
+			report_abort("unknown argument %s", argv[i]);
+
+		if (!strncmp(argv[i], "lock=", 5))
+			only = argv[i] + 5;
+		else if (!strncmp(argv[i], "period=", 7))
+			period_ms = val;
+		else if (!strncmp(argv[i], "cs=", 3))
+			cs_iters = val;
+		else if (!strncmp(argv[i], "ncs=", 4))
+			ncs_iters = val;
+		else if (!strncmp(argv[i], "wfe=", 4))
+			use_wfe = val;
+		else
+			report_abort("unknown argument %s", argv[i]);
+	}
+	if (period_ms <= 0 || cs_iters < 0 || ncs_iters < 0)
+		report_abort("invalid arguments");
+
+	freq = get_cntfrq();
+	bench_cpus = memalign(64, nr_cpus * sizeof(*bench_cpus));
+	assert(bench_cpus);
+
+	report_info("waiting with %s, cs %ld ncs %ld", use_wfe ? "wfe" : "yield",
+		    cs_iters, ncs_iters);
+	printf("%-8s%6s%12s%10s%10s%10s%10s\n", "lock", "vcpus", "acq/ms",
+	       "p50 ns", "p99 ns", "min", "max");
+
+	for (i = 0; i < ARRAY_SIZE(bench_locks); i++) {
+		if (only && strcmp(only, bench_locks[i].name))
+			continue;
+		for (nr = 1; nr < nr_cpus; nr *= 2)
+			bench_one(&bench_locks[i], nr);
+		bench_one(&bench_locks[i], nr_cpus);
+	}
+
+	report_prefix_pop();
+	report_prefix_pop();
+	return report_summary();
+}
+
 int main(int argc, char **argv)
 {
 	report_prefix_push("spinlock");
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return lock_bench_main(argc, argv);
+
 	if (argc > 1 && strcmp(argv[1], "bad") != 0) {
 		lock_ops.lock = gcc_builtin_lock;
 		lock_ops.unlock = gcc_builtin_unlock;
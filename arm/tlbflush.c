@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Test and measure remote TLB flushes: IPIs vs broadcast TLBI
+ *
+ * One page of virtual address space is remapped round after round, from
+ * one physical page to nothing, to another one and to nothing again, which
+ * keeps to break-before-make. CPU 0 writes the PTE and then invalidates it
+ * on all the other vCPUs, which cached the old translation:
+ *   ipi      TLBI VAAE1 locally, then an SGI to each of them, whose handler
+ *            does TLBI VAAE1 and acknowledges it,
+ *   tlbi-is  TLBI VAAE1IS, which is done once DSB ISH completes, without
+ *            interrupting anyone but on all vCPUs whatever their number.
+ * Then every vCPU reads the page and must see the new mapping, or fault
+ * if it is gone. The latency is from the PTE update until the flush is
+ * known to have completed everywhere, for 2, 4, ... all vCPUs, along with
+ * the flushes per second that makes for one vCPU.
+ *
+ * Usage: tlbflush [rounds=<N>]
+ *   rounds  flushes for each mode and vCPU count, default 1000
+ */
+#include <libcflat.h>
+#include <alloc.h>
+#include <alloc_page.h>
+#include <bench.h>
+#include <tlbflush.h>
+#include <vmalloc.h>
+#include <asm/barrier.h>
+#include <asm/gic.h>
+#include <asm/mmu.h>
+#include <asm/processor.h>
+#include <asm/smp.h>
+#include <asm/thread_info.h>
+
+#define FLUSH_SGI	1
+
+enum mode {
+	MODE_IPI,
+	MODE_TLBI_IS,
+	NR_MODES
+};
+
+static const char * const mode_names[NR_MODES] = {
+	"ipi", "tlbi-is",
+};
+
+/* What the test page maps in turn, odd states are unmapped. */
+#define NR_STATES	4
+
+static struct {
+	int faulted;
+} __attribute__((aligned(64))) pcpus[NR_CPUS];
+
+static unsigned long *test_va;
+static pteval_t *test_ptep;
+static pteval_t ptes[2];
+static const unsigned long markers[2] = { 0x11111111, 0x22222222 };
+static int state;
+
+static int nr_flushed;
+
+static uint64_t cntvct_read(void)
+{
+	isb();
+	return get_cntvct();
+}
+
+static struct bench_clock clock = {
+	.unit = "ticks",
+	.read = cntvct_read,
+};
+
+static void irq_handler(struct pt_regs *regs)
+{
+	u32 irqstat = gic_read_iar();
+
+	if (gic_iar_irqnr(irqstat) == GICC_INT_SPURIOUS)
+		return;
+	gic_write_eoir(irqstat);
+
+	if (gic_iar_irqnr(irqstat) == FLUSH_SGI) {
+		local_flush_tlb_page((unsigned long)test_va);
+		__sync_fetch_and_add(&nr_flushed, 1);
+	}
+}
+
+/* Skip the faulting load of check_mapping(). */
+static void dabt_handler(struct pt_regs *regs, unsigned int esr)
+{
+	pcpus[smp_processor_id()].faulted = 1;
+	regs->pc += 4;
+}
+
+static void local_flush(void)
+{
+	local_flush_tlb_page((unsigned long)test_va);
+}
+
+static void check_mapping(void)
+{
+	int me = smp_processor_id();
+	unsigned long val = 0;
+
+	pcpus[me].faulted = 0;
+	asm volatile("ldr %0, [%1]" : "+r" (val) : "r" (test_va) : "memory");
+
+	if (state & 1 ? !pcpus[me].faulted :
+	    pcpus[me].faulted || val != markers[state / 2])
+		tlbflush_stale();
+}
+
+static void worker(void *data)
+{
+	install_irq_handler(EL1H_IRQ, irq_handler);
+	install_exception_handler(EL1H_SYNC, ESR_EL1_EC_DABT_EL1, dabt_handler);
+	gic_enable_defaults();
+
+	local_irq_enable();
+	tlbflush_serve(smp_processor_id());
+	local_irq_disable();
+
+	install_exception_handler(EL1H_SYNC, ESR_EL1_EC_DABT_EL1, NULL);
+	tlbflush_ack();
+}
+
+static void remap(void)
+{
+	state = (state + 1) % NR_STATES;
+	WRITE_ONCE(*test_ptep, state & 1 ? 0 : ptes[state / 2]);
+}
+
+/* Returns the latency of the flush, local one included. */
+static uint64_t flush_all(int m)
+{
+	uint64_t start, end;
+	int cpu, sent = 0;
+
+	nr_flushed = 0;
+	start = cntvct_read();
+	if (m == MODE_IPI) {
+		local_flush_tlb_page((unsigned long)test_va);
+		/* The other walkers must see the PTE before they flush. */
+		dsb(ishst);
+		for (cpu = 1; cpu < tlbflush_nr_active; cpu++) {
+			gic_ipi_send_single(FLUSH_SGI, cpu);
+			sent++;
+		}
+		while (READ_ONCE(nr_flushed) < sent)
+			cpu_relax();
+	} else {
+		flush_tlb_page((unsigned long)test_va);
+	}
+	end = cntvct_read();
+
+	return end - start;
+}
+
+static const struct tlbflush_ops ops = {
+	.clock = &clock,
+	.mode_names = mode_names,
+	.local_flush = local_flush,
+	.check = check_mapping,
+	.remap = remap,
+	.flush = flush_all,
+};
+
+int main(int argc, char **argv)
+{
+	pgd_t *pgtable = current_thread_info()->pgtable;
+	unsigned long *page;
+	int cpu, i, m;
+
+	report_prefix_push("tlbflush");
+	tlbflush_parse_args(argc, argv);
+
+	if (nr_cpus < 2) {
+		report_skip("need at least 2 cpus");
+		goto out;
+	}
+
+	if (!gic_init()) {
+		report_skip("no supported gic");
+		goto out;
+	}
+
+	clock.freq = get_cntfrq();
+	tlbflush_init(&ops, nr_cpus, 0);
+
+	/* Let install_page() work out the PTEs, then take over. */
+	test_va = alloc_vpage();
+	for (i = 1; i >= 0; i--) {
+		page = alloc_page();
+		assert(page);
+		page[0] = markers[i];
+		test_ptep = install_page(pgtable, virt_to_phys(page), test_va);
+		ptes[i] = *test_ptep;
+	}
+
+	for (cpu = 1; cpu < nr_cpus; cpu++)
+		on_cpu_async(cpu, worker, NULL);
+	tlbflush_wait_ready();
+
+	report_info("%d vcpus, %ld flushes per mode and vcpu count", nr_cpus,
+		    tlbflush_rounds);
+	bench_print_header(&clock);
+	for (m = 0; m < NR_MODES; m++)
+		tlbflush_run_mode(m);
+
+	tlbflush_exit();
+
+out:
+	report_prefix_pop();
+	return report_summary();
+}
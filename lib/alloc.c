@@ -41,3 +41,8 @@ void *memalign(size_t alignment, size_t size)
 
 	return (void *)p;
 }
+
+int __attribute__((__weak__)) alloc_cpu_id(void)
+{
+	return -1;
+}
@@ -34,4 +34,13 @@ void *calloc(size_t nmemb, size_t size);
 void free(void *ptr);
 void *memalign(size_t alignment, size_t size);
 
+/*
+ * Index of the calling CPU, used by the allocators to pick a per-CPU
+ * cache, or a negative value if the architecture can't tell cheaply.
+ * The weak default returns -1, which makes the allocators take their
+ * global lock for every operation, as do CPUs past ALLOC_NR_CPUS.
+ */
+#define ALLOC_NR_CPUS	64
+int alloc_cpu_id(void);
+
 #endif /* _ALLOC_H_ */
@@ -33,6 +33,9 @@
 
 #define IS_USABLE(x)	(IS_FREE(x) || IS_FRESH(x))
 
+/* A single page sitting in a per-CPU cache, with an order no block has */
+#define PAGE_CACHED		(STATUS_ALLOCATED | ORDER_MASK)
+
 typedef phys_addr_t pfn_t;
 
 struct mem_area {
@@ -55,6 +58,31 @@ static unsigned int areas_mask;
 /* Protects areas and areas mask */
 static struct spinlock lock;
 
+/*
+ * Per-CPU caches of single pages, one for each CPU and area. Order 0
+ * allocations and frees only take the lock of the cache of the calling
+ * CPU, which is uncontended, while the cache is refilled from and drained
+ * to the free lists PCP_BATCH pages at a time under the global lock.
+ * Cached pages are allocated as far as the free lists are concerned, and
+ * marked PAGE_CACHED so that freeing them again is caught.
+ * Lock order: pcp->lock, then lock.
+ */
+#define PCP_BATCH	16
+#define PCP_HIGH	(4 * PCP_BATCH)
+
+struct pcp {
+	struct spinlock lock;
+	/* Cached pages, linked through their first word */
+	void *pages;
+	unsigned int count;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long frees;
+	unsigned long drains;
+};
+
+static struct pcp pcps[ALLOC_NR_CPUS][MAX_AREAS];
+
 bool page_alloc_initialized(void)
 {
 	return areas_mask != 0;
@@ -281,6 +309,8 @@ static void _free_pages(void *mem)
 	p = pfn - a->base;
 	order = a->page_states[p] & ORDER_MASK;
 
+	/* ensure that the page is not already free in a per-CPU cache */
+	assert_msg(a->page_states[p] != PAGE_CACHED, "double free of cached page %p", mem);
 	/* ensure that the first page is allocated and not special */
 	assert(IS_ALLOCATED(a->page_states[p]));
 	/* ensure that the order has a sane value */
@@ -317,13 +347,155 @@ static void _free_pages(void *mem)
 	} while (coalesce(a, order, pfn, pfn2));
 }
 
+static u8 *page_state(struct mem_area *a, void *page)
+{
+	return a->page_states + virt_to_pfn(page) - a->base;
+}
+
+/*
+ * Give @nr pages from the cache of area @a back to the free lists.
+ * The function is called with pcp->lock held.
+ */
+static void pcp_drain(struct mem_area *a, struct pcp *pcp, unsigned int nr)
+{
+	void *page;
+
+	assert(nr <= pcp->count);
+	spin_lock(&lock);
+	for (pcp->count -= nr; nr; nr--) {
+		page = pcp->pages;
+		pcp->pages = *(void **)page;
+		*page_state(a, page) = STATUS_ALLOCATED;
+		_free_pages(page);
+	}
+	spin_unlock(&lock);
+	pcp->drains++;
+}
+
+/*
+ * Allocate a page from the caches of the calling CPU for the areas in
+ * @area_mask, in the same order as the free lists would be searched.
+ */
+static void *pcp_alloc(struct pcp *cpu_pcps, unsigned int area_mask)
+{
+	struct pcp *pcp;
+	void *page;
+	int i;
+
+	for (i = 0; i < MAX_AREAS; i++) {
+		if (!(area_mask & BIT(i)))
+			continue;
+		pcp = cpu_pcps + i;
+		spin_lock(&pcp->lock);
+		if (pcp->count) {
+			pcp->hits++;
+		} else {
+			pcp->misses++;
+			spin_lock(&lock);
+			while (pcp->count < PCP_BATCH) {
+				page = page_memalign_order(areas + i, 0, 0, false);
+				if (!page)
+					break;
+				*page_state(areas + i, page) = PAGE_CACHED;
+				*(void **)page = pcp->pages;
+				pcp->pages = page;
+				pcp->count++;
+			}
+			spin_unlock(&lock);
+		}
+		page = pcp->pages;
+		if (page) {
+			pcp->pages = *(void **)page;
+			pcp->count--;
+			*page_state(areas + i, page) = STATUS_ALLOCATED;
+		}
+		spin_unlock(&pcp->lock);
+		if (page)
+			return page;
+	}
+	return NULL;
+}
+
+/*
+ * Put @mem in the cache of the calling CPU if it is a single page.
+ * Returns false if it must be freed directly instead.
+ */
+static bool pcp_free(struct pcp *cpu_pcps, void *mem)
+{
+	pfn_t pfn = virt_to_pfn(mem);
+	struct mem_area *a;
+	struct pcp *pcp;
+
+	if (!IS_ALIGNED((uintptr_t)mem, PAGE_SIZE))
+		return false;
+	a = get_area(pfn);
+	/* only single allocated pages are cached, _free_pages() checks the rest */
+	if (!a || *page_state(a, mem) != (STATUS_ALLOCATED | 0))
+		return false;
+
+	pcp = cpu_pcps + (a - areas);
+	spin_lock(&pcp->lock);
+	*page_state(a, mem) = PAGE_CACHED;
+	*(void **)mem = pcp->pages;
+	pcp->pages = mem;
+	pcp->frees++;
+	if (++pcp->count >= PCP_HIGH)
+		pcp_drain(a, pcp, PCP_BATCH);
+	spin_unlock(&pcp->lock);
+	return true;
+}
+
+static void pcp_drain_all(void)
+{
+	struct pcp *pcp;
+	int cpu, i;
+
+	for (cpu = 0; cpu < ALLOC_NR_CPUS; cpu++) {
+		for (i = 0; i < MAX_AREAS; i++) {
+			pcp = &pcps[cpu][i];
+			spin_lock(&pcp->lock);
+			if (pcp->count)
+				pcp_drain(areas + i, pcp, pcp->count);
+			spin_unlock(&pcp->lock);
+		}
+	}
+}
+
 void free_pages(void *mem)
 {
+	int cpu = alloc_cpu_id();
+
+	if (mem && cpu >= 0 && cpu < ALLOC_NR_CPUS && pcp_free(pcps[cpu], mem))
+		return;
+
 	spin_lock(&lock);
 	_free_pages(mem);
 	spin_unlock(&lock);
 }
 
+void page_alloc_print_stats(void)
+{
+	unsigned long hits = 0, misses = 0;
+	struct pcp *pcp;
+	int cpu, i;
+
+	for (cpu = 0; cpu < ALLOC_NR_CPUS; cpu++) {
+		for (i = 0; i < MAX_AREAS; i++) {
+			pcp = &pcps[cpu][i];
+			if (!pcp->hits && !pcp->misses && !pcp->frees)
+				continue;
+			printf("page cache cpu %d area %d: %lu hits, %lu misses, "
+			       "%lu frees, %lu drains, %u cached\n", cpu, i,
+			       pcp->hits, pcp->misses, pcp->frees, pcp->drains,
+			       pcp->count);
+			hits += pcp->hits;
+			misses += pcp->misses;
+		}
+	}
+	printf("page cache: %lu%% hit rate\n",
+	       hits + misses ? hits * 100 / (hits + misses) : 0);
+}
+
 static int _reserve_one_page(pfn_t pfn)
 {
 	struct mem_area *a;
@@ -356,13 +528,10 @@ static void _unreserve_one_page(pfn_t pfn)
 	_free_pages(pfn_to_virt(pfn));
 }
 
-int reserve_pages(phys_addr_t addr, size_t n)
+static int _reserve_pages(pfn_t pfn, size_t n)
 {
-	pfn_t pfn;
 	size_t i;
 
-	assert(IS_ALIGNED(addr, PAGE_SIZE));
-	pfn = addr >> PAGE_SHIFT;
 	spin_lock(&lock);
 	for (i = 0; i < n; i++)
 		if (_reserve_one_page(pfn + i))
@@ -376,6 +545,19 @@ int reserve_pages(phys_addr_t addr, size_t n)
 	return -!n;
 }
 
+int reserve_pages(phys_addr_t addr, size_t n)
+{
+	pfn_t pfn;
+
+	assert(IS_ALIGNED(addr, PAGE_SIZE));
+	pfn = addr >> PAGE_SHIFT;
+	if (!_reserve_pages(pfn, n))
+		return 0;
+	/* some of the pages might just be sitting in a per-CPU cache */
+	pcp_drain_all();
+	return _reserve_pages(pfn, n);
+}
+
 void unreserve_pages(phys_addr_t addr, size_t n)
 {
 	pfn_t pfn;
@@ -389,18 +571,37 @@ void unreserve_pages(phys_addr_t addr, size_t n)
 	spin_unlock(&lock);
 }
 
-static void *page_memalign_order_flags(u8 al, u8 ord, u32 flags)
+static void *_page_memalign_order_flags(u8 al, u8 ord, u32 flags)
 {
+	int i, area, fresh, cpu;
 	void *res = NULL;
-	int i, area, fresh;
 
 	fresh = !!(flags & FLAG_FRESH);
+	cpu = alloc_cpu_id();
+	if (!al && !ord && !fresh && cpu >= 0 && cpu < ALLOC_NR_CPUS) {
+		area = (flags & AREA_MASK) ? flags & areas_mask : areas_mask;
+		return pcp_alloc(pcps[cpu], area);
+	}
+
 	spin_lock(&lock);
 	area = (flags & AREA_MASK) ? flags & areas_mask : areas_mask;
 	for (i = 0; !res && (i < MAX_AREAS); i++)
 		if (area & BIT(i))
 			res = page_memalign_order(areas + i, al, ord, fresh);
 	spin_unlock(&lock);
+	return res;
+}
+
+static void *page_memalign_order_flags(u8 al, u8 ord, u32 flags)
+{
+	void *res;
+
+	res = _page_memalign_order_flags(al, ord, flags);
+	if (!res) {
+		/* the memory might just be sitting in per-CPU caches */
+		pcp_drain_all();
+		res = _page_memalign_order_flags(al, ord, flags);
+	}
 	if (res && !(flags & FLAG_DONTZERO))
 		memset(res, 0, BIT(ord) * PAGE_SIZE);
 	return res;
@@ -415,6 +616,74 @@ void *alloc_pages_flags(unsigned int order, unsigned int flags)
 	return page_memalign_order_flags(order, order, flags);
 }
 
+/*
+ * Fill @pages with up to @nr single pages from the given area, carving
+ * them out of the largest blocks that are not bigger than needed.
+ * Returns the number of pages allocated.
+ * The function is called with the lock held.
+ */
+static size_t area_alloc_bulk(struct mem_area *a, void **pages, size_t nr)
+{
+	size_t done = 0, i;
+	void *block;
+	pfn_t pfn;
+	u8 order;
+
+	while (done < nr) {
+		order = MIN(fls(nr - done), a->max_order);
+		while (!(block = page_memalign_order(a, 0, order, false)) && order)
+			order--;
+		if (!block)
+			break;
+		/* hand the block out as individual pages */
+		pfn = virt_to_pfn(block);
+		memset(a->page_states + pfn - a->base, STATUS_ALLOCATED, BIT(order));
+		for (i = 0; i < BIT(order); i++)
+			pages[done++] = pfn_to_virt(pfn + i);
+	}
+	return done;
+}
+
+static size_t _alloc_pages_bulk(void **pages, size_t nr, unsigned int flags)
+{
+	size_t done = 0;
+	int i, area;
+
+	spin_lock(&lock);
+	area = (flags & AREA_MASK) ? flags & areas_mask : areas_mask;
+	for (i = 0; done < nr && i < MAX_AREAS; i++)
+		if (area & BIT(i))
+			done += area_alloc_bulk(areas + i, pages + done, nr - done);
+	spin_unlock(&lock);
+	return done;
+}
+
+size_t alloc_pages_bulk(void **pages, size_t nr, unsigned int flags)
+{
+	size_t done, i;
+
+	done = _alloc_pages_bulk(pages, nr, flags);
+	if (done < nr) {
+		/* the memory might just be sitting in per-CPU caches */
+		pcp_drain_all();
+		done += _alloc_pages_bulk(pages + done, nr - done, flags);
+	}
+	if (!(flags & FLAG_DONTZERO))
+		for (i = 0; i < done; i++)
+			memset(pages[i], 0, PAGE_SIZE);
+	return done;
+}
+
+void free_pages_bulk(void **pages, size_t nr)
+{
+	size_t i;
+
+	spin_lock(&lock);
+	for (i = 0; i < nr; i++)
+		_free_pages(pages[i]);
+	spin_unlock(&lock);
+}
+
 /*
  * Allocates (1 << order) physically contiguous aligned pages.
  * Returns NULL if the allocation was not possible.
@@ -78,6 +78,22 @@ static inline void *alloc_page(void)
 	return alloc_pages(0);
 }
 
+/*
+ * Allocate up to nr single, not necessarily contiguous, pages with the
+ * specified flags and store them in pages, taking the allocator lock only
+ * once. Pages are zeroed unless FLAG_DONTZERO is given.
+ * Returns the number of pages allocated, which is less than nr only if
+ * memory ran out.
+ */
+size_t alloc_pages_bulk(void **pages, size_t nr, unsigned int flags);
+
+/*
+ * Free nr memory blocks allocated with any of the memalign_pages* or
+ * alloc_pages* functions, taking the allocator lock only once.
+ * NULL entries are skipped.
+ */
+void free_pages_bulk(void **pages, size_t nr);
+
 /*
  * Frees a memory block allocated with any of the memalign_pages* or
  * alloc_pages* functions.
@@ -103,6 +119,12 @@ static inline void free_pages_by_order(void *mem, unsigned int order)
 	free_pages(mem);
 }
 
+/*
+ * Print, for each CPU and memory area, how often single page allocations
+ * were served from the per-CPU page cache.
+ */
+void page_alloc_print_stats(void);
+
 /*
  * Reserves the specified physical memory range if possible.
  * If the specified range cannot be reserved in its entirety, no action is
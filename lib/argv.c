@@ -33,9 +33,14 @@ void __setup_args(void)
 	char **argv = __argv + __argc;
 
 	while (*(args = skip_blanks(args)) != '\0') {
+		assert_msg(argv < __argv + ARRAY_SIZE(__argv) - 1,
+			   "too many arguments");
 		*argv++ = copy_ptr;
-		while (*args != '\0' && !isblank(*args))
+		while (*args != '\0' && !isblank(*args)) {
+			assert_msg(copy_ptr < args_copy + sizeof(args_copy) - 1,
+				   "arguments too long");
 			*copy_ptr++ = *args++;
+		}
 		*copy_ptr++ = '\0';
 	}
 	__argc = argv - __argv;
@@ -52,6 +57,9 @@ void setup_args(const char *args)
 
 void add_setup_arg(const char *arg)
 {
+	assert_msg(__argc < (int)ARRAY_SIZE(__argv) - 1, "too many arguments");
+	assert_msg(strlen(arg) < (size_t)(args_copy + sizeof(args_copy) - copy_ptr),
+		   "arguments too long");
 	__argv[__argc] = copy_ptr;
 	strcpy(__argv[__argc], arg);
 	copy_ptr += strlen(arg) + 1;
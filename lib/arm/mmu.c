@@ -202,6 +202,19 @@ void mmu_set_range_sect(pgd_t *pgtable, uintptr_t virt_offset,
 	}
 }
 
+/* Only PMD sections, which virt_to_pte_phys() knows about */
+unsigned int vm_block_order(unsigned int max_order)
+{
+	return max_order >= PMD_SHIFT - PAGE_SHIFT ? PMD_SHIFT - PAGE_SHIFT : 0;
+}
+
+void install_block(pgd_t *pgtable, phys_addr_t phys, void *virt, unsigned int order)
+{
+	assert(order == PMD_SHIFT - PAGE_SHIFT);
+	mmu_set_range_sect(pgtable, (uintptr_t)virt, phys, phys + PMD_SIZE,
+			   __pgprot(PTE_WBWA | PTE_USER));
+}
+
 void *setup_mmu(phys_addr_t phys_end, void *unused)
 {
 	struct mem_region *r;
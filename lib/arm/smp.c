@@ -6,6 +6,7 @@
  * This work is licensed under the terms of the GNU LGPL, version 2.
  */
 #include <libcflat.h>
+#include <alloc.h>
 #include <auxinfo.h>
 #include <cpumask.h>
 #include <asm/thread_info.h>
@@ -65,6 +66,11 @@ static void __smp_boot_secondary(int cpu, secondary_entry_fn entry)
 		smp_wait_for_event();
 }
 
+int alloc_cpu_id(void)
+{
+	return smp_processor_id();
+}
+
 void smp_boot_secondary(int cpu, secondary_entry_fn entry)
 {
 	spin_lock(&lock);
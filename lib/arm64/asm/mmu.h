@@ -19,6 +19,15 @@ static inline void flush_tlb_all(void)
 	isb();
 }
 
+static inline void local_flush_tlb_page(unsigned long vaddr)
+{
+	unsigned long page = vaddr >> 12;
+	dsb(nshst);
+	asm("tlbi	vaae1, %0" :: "r" (page));
+	dsb(nsh);
+	isb();
+}
+
 static inline void flush_tlb_page(unsigned long vaddr)
 {
 	unsigned long page = vaddr >> 12;
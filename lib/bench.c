@@ -0,0 +1,316 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Simple micro-benchmark harness shared by the exit-cost tests.
+ */
+#include <libcflat.h>
+#include <alloc.h>
+#include <bench.h>
+
+#define PS_PER_SEC	1000000000000ULL
+
+const char *bench_unit(const struct bench_clock *clock)
+{
+	return clock->freq ? "ns" : clock->unit;
+}
+
+/* ticks * 10^12 / freq without overflowing for any sane tick count */
+static uint64_t ticks_to_ps(uint64_t ticks, uint64_t freq)
+{
+	uint64_t q = ticks / freq, r = ticks % freq;
+	uint64_t us = r * 1000000 / freq;
+	uint64_t rest = (r * 1000000 % freq) * 1000000 / freq;
+
+	return q * PS_PER_SEC + us * 1000000 + rest;
+}
+
+uint64_t bench_scale(const struct bench_clock *clock, uint64_t ticks,
+		     unsigned long iters)
+{
+	uint64_t val;
+
+	/* With a known frequency, ps == ns * BENCH_SCALE. */
+	if (clock->freq)
+		val = ticks_to_ps(ticks, clock->freq);
+	else
+		val = ticks * BENCH_SCALE;
+
+	return val / iters;
+}
+
+static void sort_u64(uint64_t *v, unsigned int nr)
+{
+	unsigned int gap, i, j;
+	uint64_t tmp;
+
+	for (gap = nr / 2; gap > 0; gap /= 2) {
+		for (i = gap; i < nr; i++) {
+			tmp = v[i];
+			for (j = i; j >= gap && v[j - gap] > tmp; j -= gap)
+				v[j] = v[j - gap];
+			v[j] = tmp;
+		}
+	}
+}
+
+void bench_reduce(uint64_t *values, unsigned int nr, bool keep_outliers,
+		  struct bench_stats *stats)
+{
+	uint64_t sum = 0, fence;
+	unsigned int i, n = nr;
+
+	assert(nr);
+	sort_u64(values, nr);
+
+	if (!keep_outliers && nr >= 4) {
+		uint64_t q1 = values[nr / 4], q3 = values[(3 * nr) / 4];
+
+		fence = q3 + 3 * (q3 - q1);
+		while (n > 1 && values[n - 1] > fence)
+			n--;
+	}
+
+	for (i = 0; i < n; i++)
+		sum += values[i];
+
+	stats->samples = n;
+	stats->rejected = nr - n;
+	stats->min = values[0];
+	stats->median = values[n / 2];
+	stats->p99 = values[(n * 99 + 99) / 100 - 1];
+	stats->max = values[n - 1];
+	stats->mean = sum / n;
+}
+
+static unsigned long calibrate(const struct bench_clock *clock,
+			       const struct bench_params *params,
+			       struct bench *bench)
+{
+	unsigned long iters = 1;
+	uint64_t start;
+
+	for (;;) {
+		start = clock->read();
+		bench->run(bench, iters);
+		if (clock->read() - start >= params->target || iters >= (1ul << 30))
+			return iters;
+		iters *= 2;
+	}
+}
+
+bool bench_measure(const struct bench_clock *clock,
+		   const struct bench_params *params,
+		   struct bench *bench, struct bench_stats *stats)
+{
+	unsigned long iters = bench->iters ? : params->iters;
+	uint64_t *values, start, ticks, overhead;
+	unsigned int i;
+
+	assert(bench->run && params->reps);
+
+	if (bench->prep && !bench->prep(bench))
+		return false;
+
+	if (!iters)
+		iters = calibrate(clock, params, bench);
+
+	for (i = 0; i < params->warmup; i++)
+		bench->run(bench, iters);
+
+	values = bench->samples;
+	if (!values) {
+		values = malloc(params->reps * sizeof(*values));
+		assert(values);
+	}
+
+	overhead = bench->overhead * iters;
+	for (i = 0; i < params->reps; i++) {
+		start = clock->read();
+		bench->run(bench, iters);
+		ticks = clock->read() - start;
+		ticks = ticks > overhead ? ticks - overhead : 0;
+		values[i] = bench_scale(clock, ticks, iters);
+	}
+
+	stats->iters = iters;
+	bench_reduce(values, params->reps, params->keep_outliers, stats);
+	if (values != bench->samples)
+		free(values);
+
+	return true;
+}
+
+void bench_print_header(const struct bench_clock *clock)
+{
+	int i;
+
+	printf("per-iteration %s\n", bench_unit(clock));
+	printf("%-30s%16s%16s%16s%16s%10s\n",
+	       "name", "min", "median", "p99", "max", "outliers");
+	for (i = 0; i < 104; ++i)
+		printf("%c", '-');
+	printf("\n");
+}
+
+static void print_value(uint64_t val)
+{
+	printf("%12" PRIu64 ".%03" PRIu64, val / BENCH_SCALE, val % BENCH_SCALE);
+}
+
+void bench_print(const char *name, const struct bench_stats *stats)
+{
+	printf("%-30s", name);
+	print_value(stats->min);
+	print_value(stats->median);
+	print_value(stats->p99);
+	print_value(stats->max);
+	printf("%6u/%-3u\n", stats->rejected, stats->rejected + stats->samples);
+}
+
+bool bench_run(const struct bench_clock *clock,
+	       const struct bench_params *params, struct bench *bench)
+{
+	struct bench_stats stats;
+
+	if (!bench_measure(clock, params, bench, &stats)) {
+		printf("%s (skipped)\n", bench->name);
+		return false;
+	}
+
+	bench_print(bench->name, &stats);
+	return true;
+}
+
+void bench_matrix_print(const struct bench_clock *clock, const char *name,
+			const uint64_t *values, int n)
+{
+	static const char shades[] = ".:-=+*#%@";
+	int nr_shades = sizeof(shades) - 1;
+	uint64_t lo = ~0ull, hi = 0, val;
+	int i, j;
+
+	for (i = 0; i < n * n; i++) {
+		if (values[i] == BENCH_NONE)
+			continue;
+		lo = MIN(lo, values[i]);
+		hi = MAX(hi, values[i]);
+	}
+	if (lo > hi)
+		lo = hi;
+
+	printf("%s (%s), rows send, columns receive\n", name, bench_unit(clock));
+
+	if (n <= BENCH_MATRIX_NUMBERS) {
+		printf("%6s", "");
+		for (j = 0; j < n; j++)
+			printf("%8d", j);
+		printf("\n");
+		for (i = 0; i < n; i++) {
+			printf("%6d", i);
+			for (j = 0; j < n; j++) {
+				val = values[i * n + j];
+				if (val == BENCH_NONE)
+					printf("%8s", "-");
+				else
+					printf("%8" PRIu64, val / BENCH_SCALE);
+			}
+			printf("\n");
+		}
+	}
+
+	printf("heat map, '%c' %" PRIu64 " ... '%c' %" PRIu64 "\n",
+	       shades[0], lo / BENCH_SCALE, shades[nr_shades - 1], hi / BENCH_SCALE);
+	for (i = 0; i < n; i++) {
+		printf("%6d ", i);
+		for (j = 0; j < n; j++) {
+			val = values[i * n + j];
+			if (val == BENCH_NONE)
+				printf(" ");
+			else if (hi == lo)
+				printf("%c", shades[0]);
+			else
+				printf("%c", shades[(val - lo) * (nr_shades - 1) / (hi - lo)]);
+		}
+		printf("\n");
+	}
+}
+
+void bench_hist_init(struct bench_hist *hist)
+{
+	memset(hist, 0, sizeof(*hist));
+	hist->min = ~0ull;
+}
+
+static unsigned int hist_index(uint64_t val)
+{
+	unsigned int shift;
+
+	if (val < (1 << BENCH_HIST_SUB_BITS))
+		return val;
+
+	shift = 63 - __builtin_clzll(val) - (BENCH_HIST_SUB_BITS - 1);
+	return shift * BENCH_HIST_HALF + (val >> shift);
+}
+
+static uint64_t hist_highest_value(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < (1 << BENCH_HIST_SUB_BITS))
+		return idx;
+
+	shift = idx / BENCH_HIST_HALF - 1;
+	return ((uint64_t)(idx - shift * BENCH_HIST_HALF) << shift) +
+	       (1ull << shift) - 1;
+}
+
+void bench_hist_add(struct bench_hist *hist, uint64_t val)
+{
+	hist->buckets[hist_index(val)]++;
+	hist->count++;
+	hist->min = MIN(hist->min, val);
+	hist->max = MAX(hist->max, val);
+}
+
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+	int i;
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->min = MIN(dst->min, src->min);
+	dst->max = MAX(dst->max, src->max);
+}
+
+uint64_t bench_hist_value_at(const struct bench_hist *hist,
+			     unsigned int permille)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!hist->count)
+		return 0;
+
+	rank = (hist->count * permille + 999) / 1000;
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			return MIN(hist_highest_value(i), hist->max);
+	}
+
+	return hist->max;
+}
+
+void bench_hist_print(const char *name, const struct bench_hist *hist)
+{
+	printf("  hist %s min %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64
+	       " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64
+	       " (%" PRIu64 " samples)\n", name,
+	       hist->count ? hist->min : 0,
+	       bench_hist_value_at(hist, 500), bench_hist_value_at(hist, 900),
+	       bench_hist_value_at(hist, 990), bench_hist_value_at(hist, 999),
+	       hist->max, hist->count);
+}
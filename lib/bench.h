@@ -0,0 +1,137 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Simple micro-benchmark harness shared by the exit-cost tests.
+ *
+ * A benchmark is run for a number of untimed warmup repetitions followed
+ * by a number of timed repetitions of 'iters' iterations each. Every timed
+ * repetition yields one sample; samples above the upper Tukey fence
+ * (Q3 + 3 * IQR) are rejected as outliers (host preemption, interrupts)
+ * and the remaining ones are reduced to min/median/p99/max.
+ */
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <libcflat.h>
+
+/*
+ * Reported values are per iteration and scaled by BENCH_SCALE, i.e. they
+ * carry three fractional digits, which matters for coarse clocks.
+ */
+#define BENCH_SCALE		1000
+
+struct bench_clock {
+	const char *unit;		/* unit of read() when freq is unknown */
+	uint64_t (*read)(void);
+	uint64_t freq;			/* ticks per second, 0 if unknown */
+};
+
+struct bench_params {
+	unsigned int warmup;		/* untimed repetitions */
+	unsigned int reps;		/* timed repetitions, one sample each */
+	/*
+	 * Iterations per repetition for benchmarks with iters == 0. If this
+	 * is 0 as well, the count is doubled until one repetition takes at
+	 * least 'target' clock ticks.
+	 */
+	unsigned long iters;
+	uint64_t target;
+	bool keep_outliers;
+};
+
+struct bench {
+	const char *name;
+	/* Optional, return false to skip the benchmark. */
+	bool (*prep)(struct bench *bench);
+	/* Run the measured operation 'iters' times. */
+	void (*run)(struct bench *bench, unsigned long iters);
+	void *data;
+	unsigned long iters;		/* 0: use bench_params */
+	uint64_t overhead;		/* ticks per iteration to subtract */
+	/*
+	 * Optional buffer for params->reps samples, for callers that can't
+	 * allocate, e.g. when measuring on several CPUs at once.
+	 */
+	uint64_t *samples;
+};
+
+struct bench_stats {
+	unsigned long iters;		/* iterations per sample */
+	unsigned int samples;		/* samples kept */
+	unsigned int rejected;		/* outliers dropped */
+	uint64_t min;
+	uint64_t median;
+	uint64_t p99;
+	uint64_t max;
+	uint64_t mean;
+};
+
+#define BENCH_PARAMS_DEFAULT { .warmup = 2, .reps = 32, .target = 1ull << 24 }
+
+/* The unit of the values in struct bench_stats. */
+const char *bench_unit(const struct bench_clock *clock);
+
+/*
+ * Run @bench and fill @stats. Returns false if the benchmark was skipped
+ * by its prep() callback.
+ */
+bool bench_measure(const struct bench_clock *clock,
+		   const struct bench_params *params,
+		   struct bench *bench, struct bench_stats *stats);
+
+/* Convert @ticks spent in @iters iterations to a per-iteration value. */
+uint64_t bench_scale(const struct bench_clock *clock, uint64_t ticks,
+		     unsigned long iters);
+
+/*
+ * Reduce @nr values produced by bench_scale() into @stats. @values is
+ * sorted in place.
+ */
+void bench_reduce(uint64_t *values, unsigned int nr, bool keep_outliers,
+		  struct bench_stats *stats);
+
+void bench_print_header(const struct bench_clock *clock);
+void bench_print(const char *name, const struct bench_stats *stats);
+
+/* bench_measure() followed by bench_print(), or a "skipped" line. */
+bool bench_run(const struct bench_clock *clock,
+	       const struct bench_params *params, struct bench *bench);
+
+/*
+ * Print an @n x @n matrix of values produced by bench_scale(), rows being
+ * senders and columns receivers, e.g. of IPI latencies: as numbers for up
+ * to BENCH_MATRIX_NUMBERS columns, and as a heat map shaded from the lowest
+ * to the highest value. BENCH_NONE entries, e.g. the diagonal, are blank.
+ */
+#define BENCH_NONE		(~0ull)
+#define BENCH_MATRIX_NUMBERS	16
+void bench_matrix_print(const struct bench_clock *clock, const char *name,
+			const uint64_t *values, int n);
+
+/*
+ * Log-linear latency histogram for per-iteration samples: values below
+ * 2^BENCH_HIST_SUB_BITS get one bucket each, larger values get
+ * 2^(BENCH_HIST_SUB_BITS - 1) buckets per power of two. A bucket is thus
+ * 1/32 to 1/16 (3% to 6%) as wide as the values it counts, and percentiles,
+ * which report the bucket's highest value, can be up to 6.25% too high.
+ */
+#define BENCH_HIST_SUB_BITS	5
+#define BENCH_HIST_HALF		(1 << (BENCH_HIST_SUB_BITS - 1))
+#define BENCH_HIST_BUCKETS	((64 - BENCH_HIST_SUB_BITS + 2) * BENCH_HIST_HALF)
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[BENCH_HIST_BUCKETS];
+};
+
+void bench_hist_init(struct bench_hist *hist);
+void bench_hist_add(struct bench_hist *hist, uint64_t val);
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src);
+/* Highest value equivalent to the sample at @permille, e.g. 990 for p99. */
+uint64_t bench_hist_value_at(const struct bench_hist *hist,
+			     unsigned int permille);
+/* One line of p50/p90/p99/p99.9/max, in the unit of the added values. */
+void bench_hist_print(const char *name, const struct bench_hist *hist);
+
+#endif /* _BENCH_H_ */
@@ -113,6 +113,8 @@ extern void report_fail(const char *msg_fmt, ...)
 					__attribute__((format(printf, 1, 2)));
 extern void report_passed(void);
 extern int report_summary(void);
+extern int report_batch(int argc, char **argv,
+			int (*fn)(int argc, char **argv));
 
 bool simple_glob(const char *text, const char *pattern);
 
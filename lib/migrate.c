@@ -8,27 +8,30 @@
 #include <libcflat.h>
 #include "migrate.h"
 
-/* static for now since we only support migrating exactly once per test. */
-static void migrate(void)
+static int nr_migrations;
+
+/*
+ * Initiate migration and wait for it to complete. migrate_cmd keeps
+ * migrating the VM to a new QEMU every time it asks for it, so this can be
+ * called any number of times.
+ */
+void migrate(void)
 {
 	puts("Now migrate the VM, then press a key to continue...\n");
 	(void)getchar();
-	report_info("Migration complete");
+	report_info("Migration %d complete", ++nr_migrations);
 }
 
 /*
- * Initiate migration and wait for it to complete.
- * If this function is called more than once, it is a no-op.
- * Since migrate_cmd can only migrate exactly once this function can
- * simplify the control flow, especially when skipping tests.
+ * Initiate migration and wait for it to complete, unless the VM has been
+ * migrated already.
+ * Since migrate_cmd needs the test to migrate at least once, this function
+ * can simplify the control flow, especially when skipping tests.
  */
 void migrate_once(void)
 {
-	static bool migrated;
-
-	if (migrated)
+	if (nr_migrations)
 		return;
 
-	migrated = true;
 	migrate();
 }
@@ -7,29 +7,22 @@
 #include <libcflat.h>
 #include <cpumask.h>
 #include <on-cpus.h>
+#include <workq.h>
 #include <asm/barrier.h>
 #include <asm/smp.h>
 
 bool cpu0_calls_idle;
 
+/*
+ * Work for a CPU is queued, so posting it never waits for the CPU to be
+ * done with earlier work, unless its queue is full, and the CPU runs all
+ * that's queued before idling again.
+ */
 struct on_cpu_info {
-	void (*func)(void *data);
-	void *data;
+	struct workq queue;
 	cpumask_t waiters;
 };
 static struct on_cpu_info on_cpu_info[NR_CPUS];
-static cpumask_t on_cpu_info_lock;
-
-static bool get_on_cpu_info(int cpu)
-{
-	return !cpumask_test_and_set_cpu(cpu, &on_cpu_info_lock);
-}
-
-static void put_on_cpu_info(int cpu)
-{
-	int ret = cpumask_test_and_clear_cpu(cpu, &on_cpu_info_lock);
-	assert(ret);
-}
 
 static void __deadlock_check(int cpu, const cpumask_t *waiters, bool *found)
 {
@@ -60,23 +53,32 @@ static void deadlock_check(int me, int cpu)
 	}
 }
 
-static void cpu_wait(int cpu)
+/* Wait for the work posted to @cpus with @pending to complete. */
+static void cpus_wait(const u16 *cpus, int nr, int *pending)
 {
-	int me = smp_processor_id();
+	int i, me = smp_processor_id();
 
-	if (cpu == me)
-		return;
+	for (i = 0; i < nr; i++) {
+		if (cpus[i] == me)
+			continue;
+		cpumask_set_cpu(me, &on_cpu_info[cpus[i]].waiters);
+		deadlock_check(me, cpus[i]);
+	}
 
-	cpumask_set_cpu(me, &on_cpu_info[cpu].waiters);
-	deadlock_check(me, cpu);
-	while (!cpu_idle(cpu))
+	while (READ_ONCE(*pending))
 		smp_wait_for_event();
-	cpumask_clear_cpu(me, &on_cpu_info[cpu].waiters);
+
+	for (i = 0; i < nr; i++) {
+		if (cpus[i] != me)
+			cpumask_clear_cpu(me, &on_cpu_info[cpus[i]].waiters);
+	}
 }
 
 void do_idle(void)
 {
 	int cpu = smp_processor_id();
+	struct workq *queue = &on_cpu_info[cpu].queue;
+	struct workq_item work;
 
 	if (cpu == 0)
 		cpu0_calls_idle = true;
@@ -85,21 +87,32 @@ void do_idle(void)
 	smp_send_event();
 
 	for (;;) {
-		while (cpu_idle(cpu))
+		while (!workq_pop(queue, &work))
 			smp_wait_for_event();
-		smp_rmb();
-		on_cpu_info[cpu].func(on_cpu_info[cpu].data);
-		on_cpu_info[cpu].func = NULL;
-		smp_wmb();
-		set_cpu_idle(cpu, true);
+		set_cpu_idle(cpu, false);
+		work.func(work.data);
+		/* Whoever waits for the last work expects us idle. */
+		if (workq_empty(queue))
+			set_cpu_idle(cpu, true);
+		workq_complete(&work);
 		smp_send_event();
 	}
 }
 
-void on_cpu_async(int cpu, void (*func)(void *data), void *data)
+static void __on_cpu_async(int cpu, void (*func)(void *data), void *data,
+			   int *pending)
 {
-	if (cpu == smp_processor_id()) {
+	struct workq_item work = {
+		.func = func,
+		.data = data,
+		.pending = pending,
+	};
+	struct workq *queue = &on_cpu_info[cpu].queue;
+	int me = smp_processor_id();
+
+	if (cpu == me) {
 		func(data);
+		workq_complete(&work);
 		return;
 	}
 
@@ -108,47 +121,90 @@ void on_cpu_async(int cpu, void (*func)(void *data), void *data)
 
 	smp_boot_secondary_nofail(cpu, do_idle);
 
-	for (;;) {
-		cpu_wait(cpu);
-		if (get_on_cpu_info(cpu)) {
-			if ((volatile void *)on_cpu_info[cpu].func == NULL)
-				break;
-			put_on_cpu_info(cpu);
-		}
+	if (!workq_push(queue, &work)) {
+		cpumask_set_cpu(me, &on_cpu_info[cpu].waiters);
+		deadlock_check(me, cpu);
+		while (!workq_push(queue, &work))
+			smp_wait_for_event();
+		cpumask_clear_cpu(me, &on_cpu_info[cpu].waiters);
 	}
 
-	on_cpu_info[cpu].func = func;
-	on_cpu_info[cpu].data = data;
-	set_cpu_idle(cpu, false);
-	put_on_cpu_info(cpu);
 	smp_send_event();
 }
 
+void on_cpu_async(int cpu, void (*func)(void *data), void *data)
+{
+	__on_cpu_async(cpu, func, data, NULL);
+}
+
 void on_cpu(int cpu, void (*func)(void *data), void *data)
 {
-	on_cpu_async(cpu, func, data);
-	cpu_wait(cpu);
+	u16 target = cpu;
+	int pending = 1;
+
+	__on_cpu_async(cpu, func, data, &pending);
+	cpus_wait(&target, 1, &pending);
 }
 
-void on_cpus(void (*func)(void *data), void *data)
+/*
+ * A broadcast is a k-ary tree over the present CPUs, rooted at the caller:
+ * the CPU at position p hands the work to those at positions
+ * p * fanout + 1 ... p * fanout + fanout before running it itself, and
+ * only completes once all of them have, i.e. once its whole subtree is
+ * done. Neither the handoffs nor the completion checks are serialized on
+ * the caller then, which only deals with its own children.
+ */
+struct on_cpus_tree {
+	void (*func)(void *data);
+	void *data;
+	int fanout;
+	int nr;
+	u16 cpus[NR_CPUS];		/* by position, the caller first */
+	u16 pos[NR_CPUS];		/* by CPU */
+};
+
+static void on_cpus_node(void *data)
+{
+	struct on_cpus_tree *tree = data;
+	int p = tree->pos[smp_processor_id()];
+	int first = MIN(p * tree->fanout + 1, tree->nr);
+	int last = MIN(first + tree->fanout, tree->nr);
+	int pending = last - first;
+	int i;
+
+	for (i = first; i < last; i++)
+		__on_cpu_async(tree->cpus[i], on_cpus_node, tree, &pending);
+
+	tree->func(tree->data);
+
+	cpus_wait(&tree->cpus[first], last - first, &pending);
+}
+
+void on_cpus_fanout(void (*func)(void *data), void *data, int fanout)
 {
+	struct on_cpus_tree tree = {
+		.func = func,
+		.data = data,
+		.fanout = MIN(fanout, nr_cpus),
+	};
 	int cpu, me = smp_processor_id();
 
-	for_each_present_cpu(cpu) {
-		if (cpu == me)
-			continue;
-		on_cpu_async(cpu, func, data);
-	}
-	func(data);
+	assert(fanout > 0);
 
+	tree.pos[me] = tree.nr;
+	tree.cpus[tree.nr++] = me;
 	for_each_present_cpu(cpu) {
 		if (cpu == me)
 			continue;
-		cpumask_set_cpu(me, &on_cpu_info[cpu].waiters);
-		deadlock_check(me, cpu);
+		tree.pos[cpu] = tree.nr;
+		tree.cpus[tree.nr++] = cpu;
 	}
-	while (cpumask_weight(&cpu_idle_mask) < nr_cpus - 1)
-		smp_wait_for_event();
-	for_each_present_cpu(cpu)
-		cpumask_clear_cpu(me, &on_cpu_info[cpu].waiters);
+	smp_wmb();
+
+	on_cpus_node(&tree);
+}
+
+void on_cpus(void (*func)(void *data), void *data)
+{
+	on_cpus_fanout(func, data, ON_CPUS_FANOUT);
 }
@@ -11,4 +11,12 @@ void on_cpu_async(int cpu, void (*func)(void *data), void *data);
 void on_cpu(int cpu, void (*func)(void *data), void *data);
 void on_cpus(void (*func)(void *data), void *data);
 
+/*
+ * on_cpus() with every CPU handing @func on to at most @fanout others
+ * before running it. A fanout of nr_cpus - 1 or more makes the caller
+ * start every other CPU itself.
+ */
+#define ON_CPUS_FANOUT		4
+void on_cpus_fanout(void (*func)(void *data), void *data, int fanout);
+
 #endif /* _ON_CPUS_H_ */
@@ -186,6 +186,55 @@ int report_summary(void)
 	return ret;
 }
 
+#define BATCH_ARG "batch="
+
+/*
+ * "run_tests.sh -b" boots "batch" tests that only differ in their -append
+ * arguments together and passes "batch=<testname> <args>..." for each of
+ * them. Call @fn once per test with its own arguments, report prefix and
+ * counters, and end each run with a "BATCH: <testname> <result>" line for
+ * the harness to split the output on. Without batch= arguments, this is
+ * just fn(argc, argv).
+ */
+int report_batch(int argc, char **argv, int (*fn)(int argc, char **argv))
+{
+	bool failed = false, passed = false;
+	const char *name;
+	char *next;
+	int i, j, ret;
+
+	if (argc < 2 || strncmp(argv[1], BATCH_ARG, strlen(BATCH_ARG)))
+		return fn(argc, argv);
+
+	for (i = 1; i < argc; i = j) {
+		for (j = i + 1; j < argc; j++)
+			if (!strncmp(argv[j], BATCH_ARG, strlen(BATCH_ARG)))
+				break;
+
+		name = argv[i] + strlen(BATCH_ARG);
+		next = argv[j];
+		argv[i] = argv[0];
+		argv[j] = NULL;
+
+		report_prefix_push(name);
+		ret = fn(j - i, &argv[i]);
+
+		printf("BATCH: %s %s\n", name,
+		       ret == 0 ? "PASS" : ret == 77 >> 1 ? "SKIP" : "FAIL");
+		failed |= ret && ret != 77 >> 1;
+		passed |= !ret;
+
+		spin_lock(&lock);
+		tests = failures = xfailures = skipped = 0;
+		prefixes[0] = '\0';
+		spin_unlock(&lock);
+
+		argv[j] = next;
+	}
+
+	return failed ? 1 : passed ? 0 : 77 >> 1;
+}
+
 void report_abort(const char *msg_fmt, ...)
 {
 	va_list va;
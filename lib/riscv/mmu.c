@@ -28,13 +28,19 @@ static pteval_t ptep_to_pteval(pte_t *ptep)
 	return ((pteval_t)ptep >> PAGE_SHIFT) << PPN_SHIFT;
 }
 
-pte_t *get_pte(pgd_t *pgtable, uintptr_t vaddr)
+/* A valid PTE with any of R, W or X set maps memory, otherwise a table */
+static bool pte_is_leaf(pteval_t pteval)
+{
+	return pteval & (_PAGE_READ | _PAGE_WRITE | _PAGE_EXEC);
+}
+
+static pte_t *get_pte_level(pgd_t *pgtable, uintptr_t vaddr, int leaf_level)
 {
 	pte_t *ptep = (pte_t *)pgtable;
 
 	assert(pgtable && !((uintptr_t)pgtable & ~PAGE_MASK));
 
-	for (int level = NR_LEVELS - 1; level > 0; --level) {
+	for (int level = NR_LEVELS - 1; level > leaf_level; --level) {
 		pte_t *next = &ptep[pte_index(vaddr, level)];
 		if (!pte_val(*next)) {
 			void *page = alloc_page();
@@ -42,11 +48,16 @@ pte_t *get_pte(pgd_t *pgtable, uintptr_t vaddr)
 		}
 		ptep = pteval_to_ptep(pte_val(*next));
 	}
-	ptep = &ptep[pte_index(vaddr, 0)];
+	ptep = &ptep[pte_index(vaddr, leaf_level)];
 
 	return ptep;
 }
 
+pte_t *get_pte(pgd_t *pgtable, uintptr_t vaddr)
+{
+	return get_pte_level(pgtable, vaddr, 0);
+}
+
 static pteval_t *__install_page(pgd_t *pgtable, phys_addr_t paddr,
 				uintptr_t vaddr, pgprot_t prot, bool flush)
 {
@@ -74,6 +85,28 @@ pteval_t *install_page(pgd_t *pgtable, phys_addr_t phys, void *virt)
 			      __pgprot(_PAGE_READ | _PAGE_WRITE), true);
 }
 
+/* Megapages and gigapages (and bigger): leaf PTEs above the last level */
+unsigned int vm_block_order(unsigned int max_order)
+{
+	return MIN(max_order / PGDIR_BITS, NR_LEVELS - 1) * PGDIR_BITS;
+}
+
+void install_block(pgd_t *pgtable, phys_addr_t phys, void *virt, unsigned int order)
+{
+	phys_addr_t ppn = (phys >> PAGE_SHIFT) << PPN_SHIFT;
+	uintptr_t vaddr = (uintptr_t)virt;
+	int level = order / PGDIR_BITS;
+	pte_t *ptep;
+
+	assert(level && level < NR_LEVELS && order == level * PGDIR_BITS);
+	assert(!(ppn & ~PTE_PPN));
+
+	ptep = get_pte_level(pgtable, vaddr, level);
+	*ptep = __pte(ppn | _PAGE_READ | _PAGE_WRITE | _PAGE_PRESENT |
+		      _PAGE_ACCESSED | _PAGE_DIRTY);
+	local_flush_tlb_page(vaddr);
+}
+
 void mmu_set_range_ptes(pgd_t *pgtable, uintptr_t virt_offset,
 			phys_addr_t phys_start, phys_addr_t phys_end,
 			pgprot_t prot, bool flush)
@@ -172,6 +205,11 @@ phys_addr_t virt_to_pte_phys(pgd_t *pgtable, void *virt)
 		pte_t *next = &ptep[pte_index(vaddr, level)];
 		if (!pte_val(*next))
 			return 0;
+		if (pte_is_leaf(pte_val(*next))) {
+			uintptr_t mask = BIT(PGDIR_BITS * level + PAGE_SHIFT) - 1;
+
+			return __pa(pteval_to_ptep(pte_val(*next))) + (vaddr & mask & PAGE_MASK);
+		}
 		ptep = pteval_to_ptep(pte_val(*next));
 	}
 	ptep = &ptep[pte_index(vaddr, 0)];
@@ -5,6 +5,7 @@
  * Copyright (C) 2023, Ventana Micro Systems Inc., Andrew Jones <ajones@ventanamicro.com>
  */
 #include <libcflat.h>
+#include <alloc.h>
 #include <alloc_page.h>
 #include <cpumask.h>
 #include <asm/csr.h>
@@ -47,6 +48,11 @@ static void __smp_boot_secondary(int cpu, secondary_func_t func)
 	assert(ret.error == SBI_SUCCESS);
 }
 
+int alloc_cpu_id(void)
+{
+	return smp_processor_id();
+}
+
 void smp_boot_secondary(int cpu, void (*func)(void))
 {
 	int ret = cpumask_test_and_set_cpu(cpu, &cpu_started);
@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Remote TLB flush harness shared by x86/pvtlbflush and arm/tlbflush.
+ */
+#include <libcflat.h>
+#include <alloc.h>
+#include <tlbflush.h>
+#include <util.h>
+#include <asm/barrier.h>
+
+enum cmd {
+	CMD_CHECK,	/* read the page and compare with the mapping */
+	CMD_FLUSH,	/* forget the page, even if not active */
+	CMD_EXIT,
+};
+
+long tlbflush_rounds = 1000;
+int tlbflush_nr_active;
+
+static const struct tlbflush_ops *ops;
+static int nr_cpus, driver;
+static uint64_t *samples;
+
+static int cmd, cmd_seq, nr_ready, nr_acked;
+static unsigned long nr_stale;
+
+void tlbflush_parse_args(int argc, char **argv)
+{
+	long val;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (parse_keyval(argv[i], &val) < 0)
+			report_abort("unknown argument %s", argv[i]);
+
+		if (!strncmp(argv[i], "rounds=", 7))
+			tlbflush_rounds = val;
+		else
+			report_abort("unknown argument %s", argv[i]);
+	}
+
+	if (tlbflush_rounds <= 0)
+		report_abort("invalid arguments");
+}
+
+void tlbflush_init(const struct tlbflush_ops *test_ops, int cpus, int me)
+{
+	ops = test_ops;
+	nr_cpus = tlbflush_nr_active = cpus;
+	driver = me;
+	samples = malloc(tlbflush_rounds * sizeof(*samples));
+	assert(samples);
+}
+
+void tlbflush_wait_ready(void)
+{
+	while (READ_ONCE(nr_ready) < nr_cpus - 1)
+		cpu_relax();
+}
+
+bool tlbflush_is_active(int cpu)
+{
+	return (cpu - driver + nr_cpus) % nr_cpus < tlbflush_nr_active;
+}
+
+void tlbflush_stale(void)
+{
+	__sync_fetch_and_add(&nr_stale, 1);
+}
+
+void tlbflush_ack(void)
+{
+	__sync_fetch_and_add(&nr_acked, 1);
+}
+
+void tlbflush_serve(int me)
+{
+	int seen = 0, seq, c;
+
+	__sync_fetch_and_add(&nr_ready, 1);
+	for (;;) {
+		while ((seq = READ_ONCE(cmd_seq)) == seen)
+			cpu_relax();
+		seen = seq;
+		smp_rmb();
+		c = READ_ONCE(cmd);
+		if (c == CMD_EXIT)
+			break;
+		if (c == CMD_FLUSH) {
+			ops->local_flush();
+			tlbflush_ack();
+		} else if (tlbflush_is_active(me)) {
+			ops->check();
+			tlbflush_ack();
+		}
+	}
+}
+
+/* Have the active vCPUs, or all of them but for CMD_CHECK, run @c. */
+static void post_cmd(int c)
+{
+	int expected = c == CMD_CHECK ? tlbflush_nr_active - 1 : nr_cpus - 1;
+
+	nr_acked = 0;
+	WRITE_ONCE(cmd, c);
+	smp_wmb();
+	__sync_fetch_and_add(&cmd_seq, 1);
+	while (READ_ONCE(nr_acked) < expected)
+		cpu_relax();
+	smp_rmb();
+}
+
+void tlbflush_run_mode(int m)
+{
+	const char *mode = ops->mode_names[m];
+	unsigned long stale = nr_stale, flushes = 0;
+	struct bench_stats stats;
+	uint64_t ticks, total;
+	char name[32];
+	long r;
+
+	for (tlbflush_nr_active = 2; ;
+	     tlbflush_nr_active = MIN(tlbflush_nr_active * 2, nr_cpus)) {
+		if (ops->prep && !ops->prep(m))
+			goto next;
+
+		/*
+		 * Inactive vCPUs didn't get the last flushes. Then cache the
+		 * current translation on the active ones.
+		 */
+		ops->local_flush();
+		post_cmd(CMD_FLUSH);
+		post_cmd(CMD_CHECK);
+		total = 0;
+		for (r = 0; r < tlbflush_rounds; r++) {
+			ops->remap();
+			ticks = ops->flush(m);
+			total += ticks;
+			samples[r] = bench_scale(ops->clock, ticks, 1);
+			post_cmd(CMD_CHECK);
+		}
+
+		bench_reduce(samples, tlbflush_rounds, true, &stats);
+		snprintf(name, sizeof(name), "%s/%d", mode, tlbflush_nr_active);
+		bench_print(name, &stats);
+		if (ops->clock->freq)
+			printf("  %s: %" PRIu64 " flushes per second\n", name,
+			       total ? tlbflush_rounds * ops->clock->freq / total : 0);
+		else
+			printf("  %s: %" PRIu64 " flushes per Mcycle\n", name,
+			       total ? (uint64_t)tlbflush_rounds * 1000000 / total : 0);
+		if (ops->print)
+			ops->print(m, name);
+		flushes += tlbflush_rounds * (tlbflush_nr_active - 1);
+next:
+		if (tlbflush_nr_active == nr_cpus)
+			break;
+	}
+	tlbflush_nr_active = nr_cpus;
+
+	report(nr_stale == stale, "%s: no stale translations after %lu remote flushes",
+	       mode, flushes);
+}
+
+void tlbflush_exit(void)
+{
+	post_cmd(CMD_EXIT);
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Remote TLB flush harness shared by x86/pvtlbflush and arm/tlbflush.
+ *
+ * The driver vCPU remaps one test page round after round and, in each of
+ * the test's modes, flushes it on the other active vCPUs, for 2, 4, ...
+ * all vCPUs. After every flush the active vCPUs read the page, which must
+ * reflect the new mapping. The other vCPUs run tlbflush_serve(), which
+ * does that on command.
+ */
+#ifndef _TLBFLUSH_H_
+#define _TLBFLUSH_H_
+
+#include <libcflat.h>
+#include <bench.h>
+
+struct tlbflush_ops {
+	const struct bench_clock *clock;
+	const char * const *mode_names;
+	/* Drop the test page's translation on the calling vCPU. */
+	void (*local_flush)(void);
+	/* Read the test page, and call tlbflush_stale() if it is wrong. */
+	void (*check)(void);
+	/* Move the test page to its next mapping. */
+	void (*remap)(void);
+	/* Flush the test page on the active vCPUs, return the ticks it took. */
+	uint64_t (*flush)(int mode);
+	/* Optional, return false to skip @mode with the current vCPU count. */
+	bool (*prep)(int mode);
+	/* Optional, print more results for @name after each vCPU count. */
+	void (*print)(int mode, const char *name);
+};
+
+extern long tlbflush_rounds;
+extern int tlbflush_nr_active;
+
+/* Parse [rounds=<N>], flushes for each mode and vCPU count. */
+void tlbflush_parse_args(int argc, char **argv);
+
+/*
+ * Set up for @nr_cpus vCPUs, @driver being the caller. Then start the
+ * workers, which call tlbflush_serve(), and wait for them with
+ * tlbflush_wait_ready().
+ */
+void tlbflush_init(const struct tlbflush_ops *ops, int nr_cpus, int driver);
+void tlbflush_wait_ready(void);
+
+/* The driver and the tlbflush_nr_active - 1 vCPUs after it take part. */
+bool tlbflush_is_active(int cpu);
+void tlbflush_stale(void);
+
+/*
+ * Worker loop of vCPU @me, returns once the driver is done. The caller
+ * then undoes its setup and calls tlbflush_ack().
+ */
+void tlbflush_serve(int me);
+void tlbflush_ack(void);
+
+/* Run @mode for every vCPU count and report stale translations. */
+void tlbflush_run_mode(int mode);
+
+/* Release the workers. */
+void tlbflush_exit(void);
+
+#endif
@@ -16,12 +16,25 @@
 #include "vmalloc.h"
 
 #define VM_MAGIC 0x7E57C0DE
+#define SLAB_MAGIC 0x51AB51AB
+
+/* Pages allocated or freed at once by multi-page allocations */
+#define VM_BULK 32
+/* Runs of block mappings of decreasing order in a multi-page allocation */
+#define VM_BLOCK_RUNS 3
 
 #define GET_METADATA(x) (((struct metadata *)(x)) - 1)
 #define GET_MAGIC(x) (*((unsigned long *)(x) - 1))
 
 struct metadata {
 	unsigned long npages;
+	/*
+	 * The allocation starts with nr_blocks[0] blocks of 1 << order[0]
+	 * pages, followed by nr_blocks[1] blocks of 1 << order[1] pages and
+	 * so on; the rest is mapped with single pages.
+	 */
+	unsigned long nr_blocks[VM_BLOCK_RUNS];
+	unsigned int order[VM_BLOCK_RUNS];
 	unsigned long magic;
 };
 
@@ -74,20 +87,49 @@ void *alloc_vpage(void)
 	return alloc_vpages(1);
 }
 
+unsigned int __attribute__((__weak__)) vm_block_order(unsigned int max_order)
+{
+	return 0;
+}
+
+void __attribute__((__weak__)) install_block(pgd_t *pgtable, phys_addr_t phys,
+					     void *virt, unsigned int order)
+{
+	assert_msg(false, "no block mappings of order %u", order);
+}
+
 void *vmap(phys_addr_t phys, size_t size)
 {
+	unsigned int order, top;
 	void *mem, *p;
 	size_t pages;
 
 	size = PAGE_ALIGN(size);
 	pages = size / PAGE_SIZE;
-	mem = p = alloc_vpages(pages);
-
 	phys &= ~(unsigned long long)(PAGE_SIZE - 1);
-	while (pages--) {
-		install_page(page_root, phys, p);
-		phys += PAGE_SIZE;
-		p += PAGE_SIZE;
+
+	/*
+	 * Make the virtual address congruent to phys modulo the biggest
+	 * block that fits, then use blocks wherever phys is aligned.
+	 */
+	top = vm_block_order(fls(pages));
+	if (top) {
+		mem = alloc_vpages_aligned(pages + BIT(top), top);
+		mem += phys & ((PAGE_SIZE << top) - 1);
+	} else {
+		mem = alloc_vpages(pages);
+	}
+
+	for (p = mem; pages; pages -= BIT(order)) {
+		order = vm_block_order(MIN(top, fls(pages)));
+		while (order && !IS_ALIGNED(phys, PAGE_SIZE << order))
+			order = vm_block_order(order - 1);
+		if (order)
+			install_block(page_root, phys, p, order);
+		else
+			install_page(page_root, phys, p);
+		phys += PAGE_SIZE << order;
+		p += PAGE_SIZE << order;
 	}
 	return mem;
 }
@@ -114,24 +156,231 @@ static void *vm_alloc_one_page(size_t alignment)
 	return p;
 }
 
+/*
+ * Small objects are allocated from slabs: single virtual pages carved into
+ * objects of one power-of-two size class, with a struct slab at the start
+ * of the page so that vm_free can tell them apart. Objects are naturally
+ * aligned to their size, so any alignment up to the size class comes for
+ * free.
+ *
+ * Each CPU keeps a short free list per size class, which is refilled from
+ * and drained to the slabs SLAB_BATCH objects at a time under slab_lock,
+ * so that most allocations and frees take no lock at all. CPUs without an
+ * alloc_cpu_id() take slab_lock every time.
+ */
+#define SLAB_MIN_SHIFT		4
+#define SLAB_MAX_SHIFT		10
+#define SLAB_NR_CLASSES		(SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_BATCH		16
+
+struct slab {
+	unsigned long magic;
+	struct slab *next;		/* in slab_partial[class] */
+	struct slab *prev;
+	void *free;			/* objects not allocated nor cached */
+	unsigned int class;
+	unsigned int inuse;		/* objects not on the free list */
+};
+
+struct slab_cache {
+	void *free;
+	unsigned int count;
+};
+
+static struct spinlock slab_lock;
+/* slabs with at least one free object */
+static struct slab *slab_partial[SLAB_NR_CLASSES];
+static struct slab_cache slab_cpu[ALLOC_NR_CPUS][SLAB_NR_CLASSES];
+
+static struct slab *slab_of(void *obj)
+{
+	return (struct slab *)((uintptr_t)obj & PAGE_MASK);
+}
+
+/* The size class for an object, SLAB_NR_CLASSES if it is too big. */
+static unsigned int slab_class(size_t alignment, size_t size)
+{
+	unsigned int order = get_order(MAX(alignment, size));
+
+	if (order > SLAB_MAX_SHIFT)
+		return SLAB_NR_CLASSES;
+	return order > SLAB_MIN_SHIFT ? order - SLAB_MIN_SHIFT : 0;
+}
+
+static void slab_list_add(struct slab *s)
+{
+	s->prev = NULL;
+	s->next = slab_partial[s->class];
+	if (s->next)
+		s->next->prev = s;
+	slab_partial[s->class] = s;
+}
+
+static void slab_list_del(struct slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		slab_partial[s->class] = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+}
+
+/* Called with slab_lock held */
+static void slab_grow(unsigned int class)
+{
+	size_t size = 1ul << (class + SLAB_MIN_SHIFT);
+	uintptr_t obj, first;
+	struct slab *s;
+
+	s = alloc_vpage();
+	install_page(page_root, virt_to_phys(alloc_page()), s);
+	s->magic = SLAB_MAGIC;
+	s->class = class;
+	s->inuse = 0;
+	s->free = NULL;
+
+	/* build the free list backwards, so that it is in address order */
+	first = ALIGN((uintptr_t)s + sizeof(*s), size);
+	for (obj = (uintptr_t)s + PAGE_SIZE - size; obj >= first; obj -= size) {
+		*(void **)obj = s->free;
+		s->free = (void *)obj;
+	}
+	slab_list_add(s);
+}
+
+/*
+ * Move up to @nr objects of @class from the slabs to the list at @head
+ * and return how many were moved. A new slab is only added if there are
+ * no free objects at all. Called with slab_lock held.
+ */
+static unsigned int slab_get(unsigned int class, void **head, unsigned int nr)
+{
+	unsigned int i;
+	struct slab *s;
+	void *obj;
+
+	for (i = 0; i < nr; i++) {
+		if (!slab_partial[class]) {
+			if (i)
+				break;
+			slab_grow(class);
+		}
+		s = slab_partial[class];
+		obj = s->free;
+		s->free = *(void **)obj;
+		if (!s->free)
+			slab_list_del(s);
+		s->inuse++;
+		*(void **)obj = *head;
+		*head = obj;
+	}
+	return i;
+}
+
+/*
+ * Give an object back to its slab. Empty slabs are released, unless they
+ * are the only ones left with free objects. Called with slab_lock held.
+ */
+static void slab_put(void *obj)
+{
+	struct slab *s = slab_of(obj);
+	phys_addr_t page;
+
+	if (!s->free)
+		slab_list_add(s);
+	*(void **)obj = s->free;
+	s->free = obj;
+	if (--s->inuse || (slab_partial[s->class] == s && !s->next))
+		return;
+
+	slab_list_del(s);
+	s->magic = 0;
+	page = virt_to_pte_phys(page_root, s) & PAGE_MASK;
+	assert(page);
+	free_page(phys_to_virt(page));
+}
+
+static void *slab_alloc(unsigned int class)
+{
+	int cpu = alloc_cpu_id();
+	struct slab_cache *c;
+	void *obj = NULL;
+
+	if (cpu < 0 || cpu >= ALLOC_NR_CPUS) {
+		spin_lock(&slab_lock);
+		slab_get(class, &obj, 1);
+		spin_unlock(&slab_lock);
+		return obj;
+	}
+
+	c = &slab_cpu[cpu][class];
+	if (!c->free) {
+		spin_lock(&slab_lock);
+		c->count = slab_get(class, &c->free, SLAB_BATCH);
+		spin_unlock(&slab_lock);
+	}
+	obj = c->free;
+	c->free = *(void **)obj;
+	c->count--;
+	return obj;
+}
+
+static void slab_free(void *obj)
+{
+	int cpu = alloc_cpu_id();
+	struct slab_cache *c;
+	unsigned int i;
+
+	assert(slab_of(obj)->class < SLAB_NR_CLASSES);
+	if (cpu < 0 || cpu >= ALLOC_NR_CPUS) {
+		spin_lock(&slab_lock);
+		slab_put(obj);
+		spin_unlock(&slab_lock);
+		return;
+	}
+
+	c = &slab_cpu[cpu][slab_of(obj)->class];
+	*(void **)obj = c->free;
+	c->free = obj;
+	if (++c->count < 2 * SLAB_BATCH)
+		return;
+
+	spin_lock(&slab_lock);
+	for (i = 0; i < SLAB_BATCH; i++) {
+		obj = c->free;
+		c->free = *(void **)obj;
+		slab_put(obj);
+	}
+	c->count -= SLAB_BATCH;
+	spin_unlock(&slab_lock);
+}
+
 /*
  * Allocate virtual memory, with the specified minimum alignment.
+ * Objects up to 1 << SLAB_MAX_SHIFT bytes come from the slabs.
  * If the allocation fits in one page, only one page is allocated. Otherwise
  * enough pages are allocated for the object, plus one to keep metadata
- * information about the allocation.
+ * information about the allocation. As much of the object as possible is
+ * mapped with huge pages, if the architecture has them and the page
+ * allocator has big enough blocks.
  */
 static void *vm_memalign(size_t alignment, size_t size)
 {
+	void *mem, *block, *pages[VM_BULK];
+	unsigned int class, order, run;
 	struct metadata *m;
-	phys_addr_t pa;
+	size_t i, j, n;
 	uintptr_t p;
-	void *mem;
-	size_t i;
 
 	if (!size)
 		return NULL;
 	assert(is_power_of_2(alignment));
 
+	class = slab_class(alignment, size);
+	if (class < SLAB_NR_CLASSES)
+		return slab_alloc(class);
+
 	if (alignment < sizeof(uintptr_t))
 		alignment = sizeof(uintptr_t);
 	/* it fits in one page, allocate only one page */
@@ -139,21 +388,41 @@ static void *vm_memalign(size_t alignment, size_t size)
 		return vm_alloc_one_page(alignment);
 	size = PAGE_ALIGN(size) / PAGE_SIZE;
 	alignment = get_order(PAGE_ALIGN(alignment) / PAGE_SIZE);
-	mem = do_alloc_vpages(size, alignment, true);
-	p = (uintptr_t)mem;
-	/* skip the metadata page */
-	mem = (void *)(p + PAGE_SIZE);
+	order = vm_block_order(fls(size));
+	mem = do_alloc_vpages(size, MAX(alignment, order), true);
+
+	/* the metadata page comes first, and is zeroed */
+	block = alloc_page();
+	assert(block);
+	install_page(page_root, virt_to_phys(block), mem);
+	p = (uintptr_t)mem + PAGE_SIZE;
+	mem = (void *)p;
+	m = GET_METADATA(mem);
+
 	/*
-	 * time to actually allocate the physical pages to back our virtual
-	 * allocation; note that we need to allocate one extra page (for the
-	 * metadata), hence the <=
+	 * time to actually allocate the physical memory to back our virtual
+	 * allocation, first in blocks as big as possible, then in pages
 	 */
-	for (i = 0; i <= size; i++, p += PAGE_SIZE) {
-		pa = virt_to_phys(alloc_page());
-		assert(pa);
-		install_page(page_root, pa, (void *)p);
+	i = 0;
+	for (run = 0; order && run < VM_BLOCK_RUNS; run++) {
+		m->order[run] = order;
+		while (size - i >= BIT(order) && (block = alloc_pages(order))) {
+			install_block(page_root, virt_to_phys(block), (void *)p, order);
+			m->nr_blocks[run]++;
+			p += PAGE_SIZE << order;
+			i += BIT(order);
+		}
+		if (i == size)
+			break;
+		order = vm_block_order(MIN(order - 1, fls(size - i)));
+	}
+	for (; i < size; i += n) {
+		n = MIN(size - i, VM_BULK);
+		j = alloc_pages_bulk(pages, n, AREA_ANY);
+		assert(j == n);
+		for (j = 0; j < n; j++, p += PAGE_SIZE)
+			install_page(page_root, virt_to_phys(pages[j]), (void *)p);
 	}
-	m = GET_METADATA(mem);
 	m->npages = size;
 	m->magic = VM_MAGIC;
 	return mem;
@@ -161,13 +430,19 @@ static void *vm_memalign(size_t alignment, size_t size)
 
 static void vm_free(void *mem)
 {
+	uintptr_t ptr, page, npages, i, j, n;
+	void *pages[VM_BULK];
 	struct metadata *m;
-	uintptr_t ptr, page, i;
+	unsigned int run;
 
 	if (!mem)
 		return;
-	/* the pointer is not page-aligned, it was a single-page allocation */
+	/* the pointer is not page-aligned, it was a slab or single-page allocation */
 	if (!IS_ALIGNED((uintptr_t)mem, PAGE_SIZE)) {
+		if (slab_of(mem)->magic == SLAB_MAGIC) {
+			slab_free(mem);
+			return;
+		}
 		assert(GET_MAGIC(mem) == VM_MAGIC);
 		page = virt_to_pte_phys(page_root, mem) & PAGE_MASK;
 		assert(page);
@@ -180,13 +455,30 @@ static void vm_free(void *mem)
 	assert(m->magic == VM_MAGIC);
 	assert(m->npages > 0);
 	assert(m->npages < BIT_ULL(BITS_PER_LONG - PAGE_SHIFT));
-	/* free all the pages including the metadata page */
-	ptr = (uintptr_t)m & PAGE_MASK;
-	for (i = 0 ; i < m->npages + 1; i++, ptr += PAGE_SIZE) {
-		page = virt_to_pte_phys(page_root, (void *)ptr) & PAGE_MASK;
-		assert(page);
-		free_page(phys_to_virt(page));
+	/* free the blocks, then the pages, then the metadata page */
+	npages = m->npages;
+	ptr = (uintptr_t)mem;
+	for (run = 0; run < VM_BLOCK_RUNS; run++) {
+		for (i = 0; i < m->nr_blocks[run]; i++) {
+			page = virt_to_pte_phys(page_root, (void *)ptr) & PAGE_MASK;
+			assert(page);
+			free_pages(phys_to_virt(page));
+			ptr += PAGE_SIZE << m->order[run];
+			npages -= BIT(m->order[run]);
+		}
+	}
+	for (i = 0; i < npages; i += n) {
+		n = MIN(npages - i, VM_BULK);
+		for (j = 0; j < n; j++, ptr += PAGE_SIZE) {
+			page = virt_to_pte_phys(page_root, (void *)ptr) & PAGE_MASK;
+			assert(page);
+			pages[j] = phys_to_virt(page);
+		}
+		free_pages_bulk(pages, n);
 	}
+	page = virt_to_pte_phys(page_root, m) & PAGE_MASK;
+	assert(page);
+	free_page(phys_to_virt(page));
 }
 
 static struct alloc_ops vmalloc_ops = {
@@ -23,6 +23,15 @@ extern void *setup_mmu(phys_addr_t top, void *opaque);
 extern phys_addr_t virt_to_pte_phys(pgd_t *pgtable, void *virt);
 /* Map the virtual address to the physical address for the given page tables */
 extern pteval_t *install_page(pgd_t *pgtable, phys_addr_t phys, void *virt);
+/*
+ * The biggest order, not larger than max_order, of a block of pages that
+ * can be mapped with a single huge page entry, or 0 if there is none.
+ * The weak default has none.
+ */
+extern unsigned int vm_block_order(unsigned int max_order);
+/* Map 1 << order pages, with an order returned by vm_block_order() */
+extern void install_block(pgd_t *pgtable, phys_addr_t phys, void *virt,
+			  unsigned int order);
 
 /* Map consecutive physical pages */
 void *vmap(phys_addr_t phys, size_t size);
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Bounded lock-free queue of work items, with any number of producers and
+ * a single consumer, e.g. one queue per CPU for on_cpu_async().
+ *
+ * Each slot carries a sequence number saying whose turn it is (Dmitry
+ * Vyukov's bounded MPMC queue): producers claim a position with a
+ * compare-and-swap on the tail, fill the slot and publish it by bumping
+ * its sequence, and the consumer hands it back the same way. Sequences
+ * are stored relative to the slot's index, so a zeroed queue is empty and
+ * ready to use.
+ */
+#ifndef _WORKQ_H_
+#define _WORKQ_H_
+
+#include <libcflat.h>
+#include <asm/barrier.h>
+
+#define WORKQ_SIZE		32	/* must be a power of two */
+
+struct workq_item {
+	void (*func)(void *data);
+	void *data;
+	/* If not NULL, decremented once func has returned. */
+	int *pending;
+};
+
+struct workq_slot {
+	unsigned long seq;
+	struct workq_item item;
+};
+
+struct workq {
+	unsigned long tail;		/* next position to claim */
+	unsigned long head;		/* next position to consume */
+	struct workq_slot slots[WORKQ_SIZE];
+};
+
+static inline unsigned long workq_lap(unsigned long pos)
+{
+	return pos & ~(WORKQ_SIZE - 1ul);
+}
+
+/* Returns false if the queue is full. */
+static inline bool workq_push(struct workq *q, const struct workq_item *item)
+{
+	unsigned long pos = READ_ONCE(q->tail);
+	struct workq_slot *slot;
+	long diff;
+
+	for (;;) {
+		slot = &q->slots[pos % WORKQ_SIZE];
+		diff = (long)(READ_ONCE(slot->seq) - workq_lap(pos));
+		if (diff < 0)
+			return false;
+		if (diff == 0 && __sync_bool_compare_and_swap(&q->tail, pos, pos + 1))
+			break;
+		pos = READ_ONCE(q->tail);
+	}
+
+	slot->item = *item;
+	smp_wmb();
+	WRITE_ONCE(slot->seq, workq_lap(pos) + 1);
+	return true;
+}
+
+/* Only the consumer may call this. Returns false if nothing is ready. */
+static inline bool workq_pop(struct workq *q, struct workq_item *item)
+{
+	unsigned long pos = q->head;
+	struct workq_slot *slot = &q->slots[pos % WORKQ_SIZE];
+
+	if (READ_ONCE(slot->seq) != workq_lap(pos) + 1)
+		return false;
+
+	smp_rmb();
+	*item = slot->item;
+	smp_mb();
+	WRITE_ONCE(slot->seq, workq_lap(pos) + WORKQ_SIZE);
+	q->head = pos + 1;
+	return true;
+}
+
+/* Only meaningful for the consumer. */
+static inline bool workq_empty(struct workq *q)
+{
+	unsigned long pos = q->head;
+
+	return READ_ONCE(q->slots[pos % WORKQ_SIZE].seq) != workq_lap(pos) + 1;
+}
+
+/* To be called by the consumer once item->func has returned. */
+static inline void workq_complete(struct workq_item *item)
+{
+	if (item->pending)
+		__sync_fetch_and_sub(item->pending, 1);
+}
+
+#endif /* _WORKQ_H_ */
@@ -4,9 +4,15 @@
 /*
  * Abuse this header file to hold the number of max-cpus, making it available
  * both in C and ASM
+ *
+ * This bounds APIC IDs rather than the number of CPUs, as per-CPU data is
+ * indexed by APIC ID; anything above 255 requires x2APIC. Only the GDT/TSS
+ * entries and the online bitmap, which the BSP needs before there is any
+ * allocator, are sized by it; AP stacks and id_map are allocated at boot.
+ * The GDT limit caps it at a bit below 4096.
  */
 
-#define MAX_TEST_CPUS (255)
+#define MAX_TEST_CPUS (2048)
 
 /*
  * Constants for various Intel APICs. (local APIC, IOAPIC, etc.)
@@ -1,4 +1,5 @@
 #include "libcflat.h"
+#include "alloc.h"
 #include "apic.h"
 #include "msr.h"
 #include "processor.h"
@@ -9,7 +10,7 @@
 static void *g_apic = (void *)APIC_DEFAULT_PHYS_BASE;
 static void *g_ioapic = (void *)IO_APIC_DEFAULT_PHYS_BASE;
 
-u8 id_map[MAX_TEST_CPUS];
+u32 *id_map;
 
 struct apic_ops {
 	u32 (*reg_read)(unsigned reg);
@@ -160,13 +161,26 @@ int enable_x2apic(void)
 	}
 }
 
+/*
+ * The xAPIC ID register only has 8 bits, before switching to x2APIC the
+ * full ID must come from CPUID.
+ */
 uint32_t pre_boot_apic_id(void)
 {
+	struct cpuid topo;
 	u32 msr_lo, msr_hi;
 
 	asm ("rdmsr" : "=a"(msr_lo), "=d"(msr_hi) : "c"(MSR_IA32_APICBASE));
 
-	return (msr_lo & APIC_EXTD) ? x2apic_id() : xapic_id();
+	if (msr_lo & APIC_EXTD)
+		return x2apic_id();
+
+	/* EBX is 0 if the topology leaf isn't implemented. */
+	topo = cpuid(0xb);
+	if (topo.b)
+		return topo.d;
+
+	return xapic_id();
 }
 
 void disable_apic(void)
@@ -251,7 +265,10 @@ void init_apic_map(void)
 {
 	unsigned int i, j = 0;
 
-	for (i = 0; i < MAX_TEST_CPUS; i++) {
+	id_map = calloc(cpu_count(), sizeof(*id_map));
+	assert(id_map);
+
+	for (i = 0; i < MAX_TEST_CPUS && j < cpu_count(); i++) {
 		if ((1ul << (i % 8)) & (online_cpus[i / 8]))
 			id_map[j++] = i;
 	}
@@ -5,7 +5,7 @@
 #include <stdint.h>
 #include "apic-defs.h"
 
-extern u8 id_map[MAX_TEST_CPUS];
+extern u32 *id_map;
 
 typedef struct {
     uint8_t vector;
@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * KVM paravirtual interface: CPUID leaves, feature bits and hypercalls,
+ * see Documentation/virt/kvm/x86/{cpuid,hypercalls}.rst in Linux.
+ */
+#ifndef _X86_KVM_PARA_H_
+#define _X86_KVM_PARA_H_
+
+#include "libcflat.h"
+#include "processor.h"
+
+#define KVM_CPUID_SIGNATURE		0x40000000
+#define KVM_CPUID_FEATURES		0x40000001
+
+#define KVM_FEATURE_STEAL_TIME		5
+#define KVM_FEATURE_PV_UNHALT		7
+#define KVM_FEATURE_PV_TLB_FLUSH	9
+#define KVM_FEATURE_PV_SEND_IPI		11
+
+#define KVM_HC_KICK_CPU			5
+#define KVM_HC_SEND_IPI			10
+
+#define MSR_KVM_STEAL_TIME		0x4b564d03
+#define KVM_MSR_ENABLED			1
+
+#define KVM_VCPU_PREEMPTED		(1 << 0)
+#define KVM_VCPU_FLUSH_TLB		(1 << 1)
+
+/* Must be 64-byte aligned. */
+struct kvm_steal_time {
+	u64 steal;
+	u32 version;
+	u32 flags;
+	u8 preempted;
+	u8 u8_pad[3];
+	u32 pad[11];
+};
+
+/*
+ * With Hyper-V enlightenments the KVM leaves move up from 0x40000000,
+ * search them like Linux does.
+ */
+static inline u32 kvm_cpuid_base(void)
+{
+	struct cpuid c;
+	u32 base, sig[4] = {};
+
+	for (base = KVM_CPUID_SIGNATURE; base < KVM_CPUID_SIGNATURE + 0x10000;
+	     base += 0x100) {
+		c = raw_cpuid(base, 0);
+		sig[0] = c.b;
+		sig[1] = c.c;
+		sig[2] = c.d;
+		if (!strcmp((char *)sig, "KVMKVMKVM"))
+			return base;
+	}
+	return 0;
+}
+
+static inline bool kvm_para_available(void)
+{
+	return kvm_cpuid_base();
+}
+
+static inline bool kvm_para_has_feature(unsigned int feature)
+{
+	u32 base = kvm_cpuid_base();
+
+	return base &&
+	       (raw_cpuid(base + KVM_CPUID_FEATURES - KVM_CPUID_SIGNATURE, 0).a &
+		BIT(feature));
+}
+
+/*
+ * KVM fixes up the wrong one of VMCALL and VMMCALL, but that costs a #UD.
+ * Cache the vendor, CPUID exits too.
+ */
+static inline bool kvm_hypercall_is_vmcall(void)
+{
+	static int vmcall = -1;
+
+	if (vmcall < 0)
+		vmcall = is_intel();
+	return vmcall;
+}
+
+static inline long kvm_hypercall2(unsigned int nr, unsigned long a0,
+				  unsigned long a1)
+{
+	long ret;
+
+	if (kvm_hypercall_is_vmcall())
+		asm volatile("vmcall" : "=a"(ret) : "a"(nr), "b"(a0), "c"(a1) : "memory");
+	else
+		asm volatile("vmmcall" : "=a"(ret) : "a"(nr), "b"(a0), "c"(a1) : "memory");
+	return ret;
+}
+
+/* Wake up the vCPU with @apic_id if it is halted, or its next HLT. */
+static inline long kvm_kick_cpu(u32 apic_id)
+{
+	return kvm_hypercall2(KVM_HC_KICK_CPU, 0, apic_id);
+}
+
+#endif /* _X86_KVM_PARA_H_ */
@@ -272,6 +272,7 @@ static inline bool is_intel(void)
 #define	X86_FEATURE_GBPAGES		(CPUID(0x80000001, 0, EDX, 26))
 #define	X86_FEATURE_RDTSCP		(CPUID(0x80000001, 0, EDX, 27))
 #define	X86_FEATURE_LM			(CPUID(0x80000001, 0, EDX, 29))
+#define	X86_FEATURE_INVLPGB		(CPUID(0x80000008, 0, EBX, 3))
 #define	X86_FEATURE_RDPRU		(CPUID(0x80000008, 0, EBX, 4))
 #define	X86_FEATURE_AMD_IBPB		(CPUID(0x80000008, 0, EBX, 12))
 #define	X86_FEATURE_NPT			(CPUID(0x8000000A, 0, EDX, 0))
@@ -775,6 +776,24 @@ static inline void invlpg(volatile void *va)
 	asm volatile("invlpg (%0)" ::"r" (va) : "memory");
 }
 
+/* rAX flags of INVLPGB, which invalidates on all CPUs until a TLBSYNC. */
+#define INVLPGB_VA			BIT(0)
+#define INVLPGB_PCID			BIT(1)
+#define INVLPGB_ASID			BIT(2)
+#define INVLPGB_INCLUDE_GLOBAL		BIT(3)
+
+static inline void invlpgb(unsigned long rax, u32 ecx, u32 edx)
+{
+	/* invlpgb */
+	asm volatile(".byte 0x0f,0x01,0xfe" :: "a" (rax), "c" (ecx), "d" (edx) : "memory");
+}
+
+static inline void tlbsync(void)
+{
+	/* tlbsync */
+	asm volatile(".byte 0x0f,0x01,0xff" ::: "memory");
+}
+
 
 static inline int invpcid_safe(unsigned long type, void *desc)
 {
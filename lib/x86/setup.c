@@ -384,7 +384,7 @@ void setup_libcflat(void)
 
 void save_id(void)
 {
-	set_bit(apic_id(), online_cpus);
+	set_bit(pre_boot_apic_id(), online_cpus);
 }
 
 void ap_start64(void)
@@ -1,5 +1,8 @@
 
 #include <libcflat.h>
+#include <acpi.h>
+#include <alloc.h>
+#include <workq.h>
 
 #include <asm/barrier.h>
 
@@ -14,13 +17,20 @@
 
 #define IPI_VECTOR 0x20
 
-typedef void (*ipi_function_type)(void *data);
-
-static struct spinlock ipi_lock;
-static volatile ipi_function_type ipi_function;
-static void *volatile ipi_data;
-static volatile int ipi_done;
-static volatile bool ipi_wait;
+/*
+ * Work for a CPU is queued, indexed by APIC ID, so CPUs can post to each
+ * other concurrently. A CPU only needs an IPI if nobody has sent it one
+ * since it last started draining its queue.
+ */
+struct ipi_queue {
+	struct workq q;
+	int kicked;
+};
+
+static struct ipi_queue *ipi_queues;
+/* Index in id_map of each APIC ID, the reverse of id_map */
+static u16 *id_index;
+static u32 nr_ids;
 static int _cpu_count;
 static atomic_t active_cpus;
 extern u8 rm_trampoline, rm_trampoline_end;
@@ -28,32 +38,50 @@ extern u8 rm_trampoline, rm_trampoline_end;
 extern u8 ap_rm_gdt_descr;
 #endif
 
+extern u32 smp_stacktop;
+
 #ifdef CONFIG_EFI
 extern u8 ap_rm_gdt, ap_rm_gdt_end;
 extern u8 ap_start32;
-extern u32 smp_stacktop;
-extern u8 stacktop;
 #endif
 
 /* The BSP is online from time zero. */
 atomic_t cpu_online_count = { .counter = 1 };
 unsigned char online_cpus[(MAX_TEST_CPUS + 7) / 8];
 
+/*
+ * Functions may enable interrupts and never return, in which case further
+ * work is run by nested IPIs; only pop with interrupts off so that those
+ * can't race with us.
+ */
+static bool ipi_pop(struct workq *q, struct workq_item *work)
+{
+	unsigned long flags = read_rflags();
+	bool ret;
+
+	cli();
+	ret = workq_pop(q, work);
+	write_rflags(flags);
+	return ret;
+}
+
+/*
+ * smp_id() is set before interrupts are enabled, and unlike apic_id() it
+ * doesn't exit to the host, which would add to the IPI costs measured.
+ */
 static __attribute__((used)) void ipi(void)
 {
-	void (*function)(void *data) = ipi_function;
-	void *data = ipi_data;
-	bool wait = ipi_wait;
+	struct ipi_queue *queue = &ipi_queues[smp_id()];
+	struct workq_item work;
 
-	if (!wait) {
-		ipi_done = 1;
-		apic_write(APIC_EOI, 0);
-	}
-	function(data);
-	atomic_dec(&active_cpus);
-	if (wait) {
-		ipi_done = 1;
-		apic_write(APIC_EOI, 0);
+	apic_write(APIC_EOI, 0);
+	/* Anything posted from now on needs a new IPI. */
+	__sync_fetch_and_and(&queue->kicked, 0);
+
+	while (ipi_pop(&queue->q, &work)) {
+		work.func(work.data);
+		atomic_dec(&active_cpus);
+		workq_complete(&work);
 	}
 }
 
@@ -77,6 +105,20 @@ int smp_id(void)
 	return this_cpu_read_smp_id();
 }
 
+/*
+ * Index of the calling CPU in id_map, from 0 to cpu_count() - 1, which
+ * tests can use for dense per-CPU arrays where APIC IDs are sparse.
+ */
+int smp_index(void)
+{
+	return id_index[smp_id()];
+}
+
+int alloc_cpu_id(void)
+{
+	return smp_id();
+}
+
 static void setup_smp_id(void *data)
 {
 	this_cpu_write_smp_id(apic_id());
@@ -84,9 +126,13 @@ static void setup_smp_id(void *data)
 
 void ap_online(void)
 {
+	/*
+	 * APs come up all at once; don't serialize them on the console, the
+	 * BSP reports how long bringup took.
+	 */
+	setup_smp_id(NULL);
 	sti();
 
-	printf("setup: CPU %" PRId32 " online\n", apic_id());
 	atomic_inc(&cpu_online_count);
 
 	/* Only the BSP runs the test's main(), APs are given work via IPIs. */
@@ -94,25 +140,35 @@ void ap_online(void)
 		asm volatile("hlt");
 }
 
+static void ipi_post(unsigned int target, const struct workq_item *work)
+{
+	atomic_inc(&active_cpus);
+	while (!workq_push(&ipi_queues[target].q, work))
+		pause();
+}
+
 static void __on_cpu(int cpu, void (*function)(void *data), void *data, int wait)
 {
 	const u32 ipi_icr = APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED | IPI_VECTOR;
 	unsigned int target = id_map[cpu];
+	int pending = 1;
+	struct workq_item work = {
+		.func = function,
+		.data = data,
+		.pending = wait ? &pending : NULL,
+	};
 
-	spin_lock(&ipi_lock);
 	if (target == smp_id()) {
 		function(data);
-	} else {
-		atomic_inc(&active_cpus);
-		ipi_done = 0;
-		ipi_function = function;
-		ipi_data = data;
-		ipi_wait = wait;
-		apic_icr_write(ipi_icr, target);
-		while (!ipi_done)
-			;
+		return;
 	}
-	spin_unlock(&ipi_lock);
+
+	ipi_post(target, &work);
+	if (!__sync_lock_test_and_set(&ipi_queues[target].kicked, 1))
+		apic_icr_write(ipi_icr, target);
+
+	while (wait && READ_ONCE(pending))
+		pause();
 }
 
 void on_cpu(int cpu, void (*function)(void *data), void *data)
@@ -125,12 +181,34 @@ void on_cpu_async(int cpu, void (*function)(void *data), void *data)
 	__on_cpu(cpu, function, data, 0);
 }
 
+/*
+ * Queue the function for every other CPU and send a single all-but-self
+ * IPI instead of one IPI per CPU: with hundreds of vCPUs that is a lot
+ * cheaper than hundreds of serialized round trips.
+ */
 void on_cpus(void (*function)(void *data), void *data)
 {
-	int cpu;
+	const u32 ipi_icr = APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED |
+			    APIC_DEST_ALLBUT | IPI_VECTOR;
+	struct workq_item work = {
+		.func = function,
+		.data = data,
+	};
+	unsigned int target, me = smp_id();
+	int i;
 
-	for (cpu = cpu_count() - 1; cpu >= 0; --cpu)
-		on_cpu_async(cpu, function, data);
+	if (cpu_count() > 1) {
+		for (i = 0; i < cpu_count(); i++) {
+			target = id_map[i];
+			if (target == me)
+				continue;
+			ipi_post(target, &work);
+			__sync_lock_test_and_set(&ipi_queues[target].kicked, 1);
+		}
+		apic_icr_write(ipi_icr, 0);
+	}
+
+	function(data);
 
 	while (cpus_active() > 1)
 		pause();
@@ -143,16 +221,21 @@ int cpus_active(void)
 
 void smp_init(void)
 {
-	int i;
 	void ipi_entry(void);
+	int i;
 
 	setup_idt();
 	init_apic_map();
+	id_index = calloc(nr_ids, sizeof(*id_index));
+	assert(id_index);
+	for (i = 0; i < cpu_count(); i++)
+		id_index[id_map[i]] = i;
+	ipi_queues = calloc(nr_ids, sizeof(*ipi_queues));
+	assert(ipi_queues);
 	set_idt_entry(IPI_VECTOR, ipi_entry, 0);
 
+	/* APs have set their own ID in ap_online(). */
 	setup_smp_id(0);
-	for (i = 1; i < cpu_count(); ++i)
-		on_cpu(i, setup_smp_id, 0);
 
 	atomic_inc(&active_cpus);
 }
@@ -254,10 +337,68 @@ static void setup_rm_gdt(void)
 #endif
 }
 
+static u32 max_apic_id;
+
+static int madt_lapic(struct acpi_subtable_header *header)
+{
+	struct acpi_madt_local_apic *lapic = (void *)header;
+
+	max_apic_id = MAX(max_apic_id, lapic->id);
+	return 0;
+}
+
+static int madt_x2apic(struct acpi_subtable_header *header)
+{
+	struct acpi_madt_local_x2apic *x2apic = (void *)header;
+
+	max_apic_id = MAX(max_apic_id, x2apic->local_apic_id);
+	return 0;
+}
+
+/*
+ * APIC IDs can be sparse, depending on the topology. Take the highest one
+ * from the MADT, or assume they are dense if there is none.
+ */
+static u32 nr_apic_ids(void)
+{
+	u32 nr = fwcfg_get_nb_cpus();
+
+	if (find_acpi_table_addr(MADT_SIGNATURE)) {
+		acpi_table_parse_madt(ACPI_MADT_TYPE_LOCAL_APIC, madt_lapic);
+		acpi_table_parse_madt(ACPI_MADT_TYPE_LOCAL_X2APIC, madt_x2apic);
+		nr = MAX(nr, max_apic_id + 1);
+	}
+
+	assert_msg(nr <= MAX_TEST_CPUS, "%u APIC IDs, MAX_TEST_CPUS is %d",
+		   nr, MAX_TEST_CPUS);
+	return nr;
+}
+
+/*
+ * One stack per APIC ID, which also holds the per-CPU data at its bottom.
+ * APs load them in 32-bit mode, so they must be below 4 GiB.
+ */
+static void alloc_ap_stacks(void)
+{
+	u32 nr = nr_ids = nr_apic_ids();
+	u64 top;
+	u8 *stacks;
+
+	stacks = memalign(PAGE_SIZE, nr * PAGE_SIZE);
+	assert(stacks);
+	memset(stacks, 0, nr * PAGE_SIZE);
+
+	top = (ulong)stacks + (u64)nr * PAGE_SIZE;
+	assert_msg(top < (1ull << 32), "AP stacks above 4 GiB");
+	smp_stacktop = top;
+}
+
 void bringup_aps(void)
 {
 	void *rm_trampoline_dst = RM_TRAMPOLINE_ADDR;
 	size_t rm_trampoline_size = (&rm_trampoline_end - &rm_trampoline) + 1;
+	u64 start;
+
 	assert(rm_trampoline_size < PAGE_SIZE);
 
 	asm volatile("cld");
@@ -272,9 +413,13 @@ void bringup_aps(void)
 
 	setup_rm_gdt();
 
-#ifdef CONFIG_EFI
-	smp_stacktop = ((u64) (&stacktop)) - PAGE_SIZE;
-#endif
+	alloc_ap_stacks();
+
+	/*
+	 * All APs are started at once and each picks the stack below
+	 * smp_stacktop that belongs to its APIC ID, see ap_start32.
+	 */
+	start = rdtsc();
 
 	/* INIT */
 	apic_icr_write(APIC_DEST_ALLBUT | APIC_DEST_PHYSICAL | APIC_DM_INIT | APIC_INT_ASSERT, 0);
@@ -287,4 +432,7 @@ void bringup_aps(void)
 	printf("smp: waiting for %d APs\n", _cpu_count - 1);
 	while (_cpu_count != atomic_read(&cpu_online_count))
 		cpu_relax();
+
+	printf("smp: %d APs online after %llu TSC cycles\n", _cpu_count - 1,
+	       rdtsc() - start);
 }
@@ -79,6 +79,7 @@ void smp_init(void);
 
 int cpu_count(void);
 int smp_id(void);
+int smp_index(void);
 int cpus_active(void);
 void on_cpu(int cpu, void (*function)(void *data), void *data);
 void on_cpu_async(int cpu, void (*function)(void *data), void *data);
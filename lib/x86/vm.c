@@ -104,6 +104,26 @@ pteval_t *install_large_page(pgd_t *cr3, phys_addr_t phys, void *virt)
     return install_pte(cr3, 2, virt, phys | flags, 0);
 }
 
+/* 2M (4M without PAE) pages, and 1G pages if supported */
+unsigned int vm_block_order(unsigned int max_order)
+{
+#ifdef __x86_64__
+    if (max_order >= 2 * PGDIR_WIDTH && this_cpu_has(X86_FEATURE_GBPAGES))
+        return 2 * PGDIR_WIDTH;
+#endif
+    return max_order >= PGDIR_WIDTH ? PGDIR_WIDTH : 0;
+}
+
+void install_block(pgd_t *cr3, phys_addr_t phys, void *virt, unsigned int order)
+{
+    phys_addr_t flags = PT_PRESENT_MASK | PT_WRITABLE_MASK | pte_opt_mask | PT_PAGE_SIZE_MASK;
+#ifdef CONFIG_EFI
+    flags |= get_amd_sev_c_bit_mask();
+#endif /* CONFIG_EFI */
+    assert(order && order % PGDIR_WIDTH == 0);
+    install_pte(cr3, order / PGDIR_WIDTH + 1, virt, phys | flags, 0);
+}
+
 pteval_t *install_page(pgd_t *cr3, phys_addr_t phys, void *virt)
 {
     phys_addr_t flags = PT_PRESENT_MASK | PT_WRITABLE_MASK | pte_opt_mask;
@@ -177,7 +197,6 @@ void *setup_mmu(phys_addr_t end_of_memory, void *opt_mask)
 {
     pgd_t *cr3 = alloc_page();
     struct vm_vcpu_info info;
-    int i;
 
     if (opt_mask)
 	pte_opt_mask = *(pteval_t *)opt_mask;
@@ -212,15 +231,18 @@ void *setup_mmu(phys_addr_t end_of_memory, void *opt_mask)
     info.cr4 = read_cr4();
     info.cr0 = read_cr0();
 
-    for (i = 1; i < cpu_count(); i++)
-        on_cpu(i, (void *)set_additional_vcpu_vmregs, &info);
+    on_cpus((void *)set_additional_vcpu_vmregs, &info);
 
     return cr3;
 }
 
 phys_addr_t virt_to_pte_phys(pgd_t *cr3, void *mem)
 {
-    return (*get_pte(cr3, mem) & PT_ADDR_MASK) + ((ulong)mem & (PAGE_SIZE - 1));
+    struct pte_search search = find_pte_level(cr3, mem, 1);
+    phys_addr_t mask = (1ull << PGDIR_BITS(search.level)) - 1;
+
+    assert(found_leaf_pte(search));
+    return (*search.pte & PT_ADDR_MASK & ~mask) + ((ulong)mem & mask);
 }
 
 /*
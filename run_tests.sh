@@ -15,12 +15,14 @@ function usage()
 {
 cat <<EOF
 
-Usage: $0 [-h] [-v] [-a] [-g group] [-j NUM-TASKS] [-t] [-l]
+Usage: $0 [-h] [-v] [-a] [-b] [-g group] [-j NUM-TASKS] [-t] [-l]
 
     -h, --help      Output this help text
     -v, --verbose   Enables verbose mode
     -a, --all       Run all tests, including those flagged as 'nodefault'
                     and those guarded by errata.
+    -b, --batch     Run tests of the 'batch' group that only differ in their
+                    -append arguments in a single guest
     -g, --group     Only execute tests in the given group
     -j, --parallel  Execute tests in parallel
     -t, --tap13     Output test results in TAP format
@@ -44,7 +46,8 @@ fi
 
 only_tests=""
 list_tests=""
-args=$(getopt -u -o ag:htj:vl -l all,group:,help,tap13,parallel:,verbose,list -- $*)
+batch_tests="no"
+args=$(getopt -u -o abg:htj:vl -l all,batch,group:,help,tap13,parallel:,verbose,list -- $*)
 [ $? -ne 0 ] && exit 2;
 set -- $args;
 while [ $# -gt 0 ]; do
@@ -53,6 +56,9 @@ while [ $# -gt 0 ]; do
             run_all_tests="yes"
             export ERRATA_FORCE=y
             ;;
+        -b | --batch)
+            batch_tests="yes"
+            ;;
         -g | --group)
             shift
             only_group=$1
@@ -89,7 +95,7 @@ done
 
 # RUNTIME_log_file will be configured later
 if [[ $tap_output == "no" ]]; then
-    process_test_output() { cat >> $RUNTIME_log_file; }
+    process_test_output() { cat >> "$RUNTIME_log_file"; }
     postprocess_suite_output() { cat; }
 else
     process_test_output() {
@@ -111,7 +117,7 @@ else
                     ;;
             esac
             echo "${line}"
-        done >> $RUNTIME_log_file
+        done >> "$RUNTIME_log_file"
     }
     postprocess_suite_output() {
         test_number=0
@@ -137,10 +143,12 @@ RUNTIME_log_stdout () {
         process_test_output "$testname"
     fi
 }
+RUNTIME_log_duration () { echo "$1 $2" >> $unittest_log_dir/durations; }
 
-function run_task()
+function spawn_task()
 {
-	local testname="$1"
+	local runner="$1"
+	local testname="$2"
 
 	while (( $(jobs | wc -l) == $unittest_run_queues )); do
 		# wait for any background test to finish
@@ -149,10 +157,222 @@ function run_task()
 
 	RUNTIME_log_file="${unittest_log_dir}/${testname}.log"
 	if [ $unittest_run_queues = 1 ]; then
-		run "$@"
+		$runner "${@:2}"
+	else
+		$runner "${@:2}" &
+	fi
+}
+
+function run_task()
+{
+	spawn_task run "$@"
+}
+
+function run_batch_task()
+{
+	spawn_task run_batch "$@"
+}
+
+# With several job slots, start the tests that took longest in the previous
+# run first, so that they don't end up stretching the tail of this one.
+# Tests without a recorded duration are assumed to be long.
+function queue_task()
+{
+	local testname="$1"
+	local ms=${test_duration[$testname]:-999999999}
+
+	queued_tasks+=("$ms run_task $(printf '%q ' "$@")")
+}
+
+function run_queued_tasks()
+{
+	local sorted task
+
+	(( ${#queued_tasks[@]} )) || return
+	mapfile -t sorted < <(printf '%s\n' "${queued_tasks[@]}" | sort -s -n -r -k1,1)
+	for task in "${sorted[@]}"; do
+		eval "${task#* }"
+	done
+}
+
+# Batched mode: "batch" tests are grouped by everything but their name and
+# -append arguments, and each group with more than one test runs in one
+# guest.  The test must call its body through report_batch(), which
+# brackets the output of every test with a "BATCH: <testname> <result>"
+# line.  Tests that can't be batched are run as usual.
+#
+# The guest copies the command line into fixed size buffers (lib/argv.c),
+# so a group is split into batches of at most batch_max_append bytes and
+# batch_max_args arguments.
+declare -A batch_names batch_append batch_args batch_nargs batch_seq
+batch_keys=()
+batch_max_append=800
+batch_max_args=90
+
+function batch_task()
+{
+	local testname="$1"
+	local groups="$2"
+	local smp="$3"
+	local kernel="$4"
+	local opts="$5"
+	local timeout="$9"
+	local args rest append entry words group key i
+
+	if ! find_word batch "$groups" || [ -n "$6$7$8" ] ||
+	   [ "${CONFIG_EFI}" == "y" ] ||
+	   find_word migration "$groups" || find_word panic "$groups" ||
+	   find_word pv-host "$groups" ||
+	   { [ -n "$only_tests" ] && ! find_word "$testname" "$only_tests"; } ||
+	   { [ -n "$only_group" ] && ! find_word "$only_group" "$groups"; } ||
+	   { [ -z "$only_group" ] && find_word nodefault "$groups" &&
+	     [ "$run_all_tests" != "yes" ]; }; then
+		$task_cmd "$@"
+		return
+	fi
+
+	eval "args=($opts)"
+	rest=()
+	for (( i = 0; i < ${#args[@]}; i++ )); do
+		if [ "${args[i]}" = "-append" ]; then
+			append+=" ${args[++i]}"
+		else
+			rest+=("${args[i]}")
+		fi
+	done
+
+	entry=" batch=$testname$append"
+	read -ra words <<< "$entry"
+
+	group=$(printf '%q ' "$kernel" "$smp" "$timeout" "$groups" "${rest[@]}")
+	key="${batch_seq[$group]:-0} $group"
+	if [ -n "${batch_names[$key]}" ] &&
+	   { (( ${#batch_append[$key]} + ${#entry} > batch_max_append )) ||
+	     (( ${batch_nargs[$key]} + ${#words[@]} > batch_max_args )); }; then
+		batch_seq[$group]=$(( ${batch_seq[$group]:-0} + 1 ))
+		key="${batch_seq[$group]} $group"
+	fi
+	if [ -z "${batch_names[$key]}" ]; then
+		batch_keys+=("$key")
+		batch_args[$key]=$(printf '%q ' "$@")
+	fi
+	batch_names[$key]+=" $testname"
+	batch_append[$key]+="$entry"
+	(( batch_nargs[$key] += ${#words[@]} ))
+}
+
+function run_batches()
+{
+	local key names name kernel smp timeout groups opts ms
+
+	for key in "${batch_keys[@]}"; do
+		names=(${batch_names[$key]})
+		if (( ${#names[@]} == 1 )); then
+			eval $task_cmd ${batch_args[$key]}
+			continue
+		fi
+
+		eval "set -- $key"
+		kernel=$2 smp=$3 timeout=${4:-$TIMEOUT} groups=$5
+		shift 5
+		opts="$(printf '%q ' "$@")-append $(printf '%q' "${batch_append[$key]# }")"
+
+		# the tests run back to back, so is their time limit
+		if [[ $timeout =~ ^([0-9]+)([smhd]?)$ ]]; then
+			timeout=$(( ${BASH_REMATCH[1]} * ${#names[@]} ))${BASH_REMATCH[2]}
+		fi
+
+		if [ $task_cmd = run_task ]; then
+			run_batch_task "${names[*]}" "$groups" "$smp" "$kernel" "$opts" "$timeout"
+			continue
+		fi
+		ms=0
+		for name in "${names[@]}"; do
+			(( ms += ${test_duration[$name]:-999999999} ))
+		done
+		queued_tasks+=("$ms run_batch_task $(printf '%q ' "${names[*]}" "$groups" "$smp" "$kernel" "$opts" "$timeout")")
+	done
+}
+
+function batch_failed()
+{
+	local testname="$1"
+	local reason="$2"
+
+	print_result "FAIL" $testname "" "$reason"
+	if [ "$tap_output" = "yes" ]; then
+		echo "not ok TEST_NUMBER - ${testname}: $reason" >&3
+	fi
+}
+
+function run_batch()
+{
+	local testnames=($1)
+	local groups="$2"
+	local smp="$3"
+	local kernel="$4"
+	local opts="$5"
+	local timeout="$6"
+	local testname=${testnames[0]}
+	local accel="$ACCEL"
+	local cmdline log output line part ms ret reason
+	local CR=$'\r'
+	local i=0
+
+	# the probe's output goes to the first test's log
+	RUNTIME_log_file="${unittest_log_dir}/${testname}.log"
+	log=$(premature_failure) && {
+		for testname in "${testnames[@]}"; do
+			print_result "SKIP" $testname "" "$(tail -1 <<< "$log")"
+		done
+		return 77
+	}
+
+	cmdline=$(get_cmdline $kernel)
+	if [ "$verbose" = "yes" ]; then
+		echo $cmdline
+	fi
+
+	ms=$(now_ms)
+	output=$(eval "$cmdline" 2>&1)
+	ret=$?
+	ms=$(( ($(now_ms) - ms) / ${#testnames[@]} ))
+
+	# split the output after each test's BATCH line
+	while IFS= read -r line; do
+		part+="$line"$'\n'
+		[[ "${line%$CR}" =~ ^BATCH:\ (.*)\ (PASS|FAIL|SKIP)$ ]] &&
+			[ "${BASH_REMATCH[1]}" = "${testnames[i]}" ] || continue
+
+		testname=${testnames[i++]}
+		RUNTIME_log_file="${unittest_log_dir}/${testname}.log"
+		RUNTIME_log_stdout $testname $kernel <<< "$part"
+		RUNTIME_log_duration $testname $ms
+		print_result ${BASH_REMATCH[2]} $testname "$(extract_summary <<< "$part")"
+		part=""
+	done <<< "$output"
+
+	if (( i == ${#testnames[@]} )); then
+		return $ret
+	fi
+
+	# the guest died in the middle of testnames[i]
+	if [ $ret -eq 124 ]; then
+		reason="timeout; duration=$timeout"
+	elif [ $ret -gt 127 ]; then
+		reason="terminated on SIG$(kill -l $(($ret - 128)))"
 	else
-		run "$@" &
+		reason="batch aborted"
 	fi
+	testname=${testnames[i++]}
+	RUNTIME_log_file="${unittest_log_dir}/${testname}.log"
+	RUNTIME_log_stdout $testname $kernel <<< "$part"
+	batch_failed $testname "$reason"
+	for testname in "${testnames[@]:i}"; do
+		batch_failed $testname "not run; batch aborted"
+	done
+
+	return $ret
 }
 
 : ${unittest_log_dir:=logs}
@@ -179,6 +399,22 @@ mkdir $unittest_log_dir || exit 2
 
 echo "BUILD_HEAD=$(cat build-head)" > $unittest_log_dir/SUMMARY
 
+RUNTIME_probe_cache=$unittest_log_dir/probe-cache
+mkdir $RUNTIME_probe_cache || exit 2
+
+# Per-test durations in ms, one "testname ms" line per run test, the last
+# line for a test winning.  Durations of tests not run this time are
+# carried over from the previous run.
+declare -A test_duration
+if [ -f $unittest_log_dir.old/durations ]; then
+    while read -r testname ms; do
+        test_duration[$testname]=$ms
+    done < $unittest_log_dir.old/durations
+fi
+for testname in "${!test_duration[@]}"; do
+    echo "$testname ${test_duration[$testname]}"
+done > $unittest_log_dir/durations
+
 if [[ $tap_output == "yes" ]]; then
     echo "TAP version 13"
 fi
@@ -189,7 +425,18 @@ trap "wait; exit 130" SIGINT
    # preserve stdout so that process_test_output output can write TAP to it
    exec 3>&1
    test "$tap_output" == "yes" && exec > /dev/null
-   for_each_unittest $config run_task
+   if (( $unittest_run_queues > 1 )); then
+       task_cmd=queue_task
+   else
+       task_cmd=run_task
+   fi
+   if [ "$batch_tests" = "yes" ]; then
+       for_each_unittest $config batch_task
+       run_batches
+   else
+       for_each_unittest $config $task_cmd
+   fi
+   run_queued_tasks
 ) | postprocess_suite_output
 
 # wait until all tasks finish
@@ -9,6 +9,7 @@
  *  Nico Boehr <nrb@linux.ibm.com>
  */
 #include <libcflat.h>
+#include <bench.h>
 #include <smp.h>
 #include <sclp.h>
 #include <hardware.h>
@@ -17,7 +18,6 @@
 #include <asm/interrupt.h>
 #include <asm/page.h>
 
-const uint64_t iters_to_normalize_to = 10000;
 char pagebuf[PAGE_SIZE] __attribute__((__aligned__(PAGE_SIZE)));
 
 static void test_sigp_sense_running(long destcpu)
@@ -210,60 +210,60 @@ struct test {
 	{"stsi322",               true,  NULL,                   test_stsi,               3, 200 },
 };
 
-struct test_result {
-	uint64_t total;
-	uint64_t best;
-	uint64_t average;
-	uint64_t worst;
-};
-
-static uint64_t tod_to_us(uint64_t tod)
+static uint64_t tod_read(void)
 {
-	return tod >> STCK_SHIFT_US;
-}
+	uint64_t tod;
 
-static uint64_t tod_to_ns(uint64_t tod)
-{
-	return tod_to_us(tod * 1000);
+	stckf(&tod);
+	return tod;
 }
 
-static uint64_t normalize_iters(uint64_t value_to_normalize, uint64_t iters)
+static const struct bench_clock tod_clock = {
+	.unit = "tod",
+	.read = tod_read,
+	.freq = (1ULL << STCK_SHIFT_US) * 1000000,
+};
+
+static const struct bench_params params = {
+	.warmup = 1,
+	.reps = 100,
+};
+
+static long testfunc_arg;
+
+static void exittime_run(struct bench *bench, unsigned long iters)
 {
-	return value_to_normalize * iters_to_normalize_to / iters;
+	struct test const *test = bench->data;
+
+	while (iters--)
+		test->testfunc(testfunc_arg);
 }
 
-static void report_iteration_result(struct test const* test, struct test_result const* test_result)
+static void report_iteration_result(struct bench_stats const *stats)
 {
-	uint64_t total = tod_to_ns(normalize_iters(test_result->total, test->iters)),
-		 best = tod_to_ns(normalize_iters(test_result->best, test->iters)),
-		 average = tod_to_ns(normalize_iters(test_result->average, test->iters)),
-		 worst = tod_to_ns(normalize_iters(test_result->worst, test->iters));
-
 	report_pass(
-		"total/best/avg/worst %lu.%03lu/%lu.%03lu/%lu.%03lu/%lu.%03lu us",
-		total / 1000, total % 1000,
-		best / 1000, best % 1000,
-		average / 1000, average % 1000,
-		worst / 1000, worst % 1000
+		"min/median/p99/max %lu.%03lu/%lu.%03lu/%lu.%03lu/%lu.%03lu ns (%u outliers)",
+		stats->min / BENCH_SCALE, stats->min % BENCH_SCALE,
+		stats->median / BENCH_SCALE, stats->median % BENCH_SCALE,
+		stats->p99 / BENCH_SCALE, stats->p99 % BENCH_SCALE,
+		stats->max / BENCH_SCALE, stats->max % BENCH_SCALE,
+		stats->rejected
 	);
 }
 
 int main(void)
 {
-	int i, j, k, testfunc_arg;
-	const int outer_iters = 100;
+	int i;
 	struct test const *current_test;
-	struct test_result result;
-	uint64_t start, end, elapsed;
+	struct bench bench = { .run = exittime_run };
+	struct bench_stats stats;
 
 	report_prefix_push("exittime");
-	report_info("reporting total/best/avg/worst normalized to %lu iterations", iters_to_normalize_to);
+	report_info("reporting min/median/p99/max per iteration over %u samples",
+		    params.reps);
 
 	for (i = 0; i < ARRAY_SIZE(exittime_tests); i++) {
 		current_test = &exittime_tests[i];
-		result.total = 0;
-		result.worst = 0;
-		result.best = -1;
 		report_prefix_pushf("%s", current_test->name);
 
 		if (host_is_tcg() && !current_test->supports_tcg) {
@@ -276,18 +276,11 @@ int main(void)
 		if (current_test->setupfunc)
 			testfunc_arg = current_test->setupfunc(testfunc_arg);
 
-		for (j = 0; j < outer_iters; j++) {
-			stckf(&start);
-			for (k = 0; k < current_test->iters; k++)
-				current_test->testfunc(testfunc_arg);
-			stckf(&end);
-			elapsed = end - start;
-			result.best = MIN(result.best, elapsed);
-			result.worst = MAX(result.worst, elapsed);
-			result.total += elapsed;
-		}
-		result.average = result.total / outer_iters;
-		report_iteration_result(current_test, &result);
+		bench.name = current_test->name;
+		bench.data = (void *)current_test;
+		bench.iters = current_test->iters;
+		bench_measure(&tod_clock, &params, &bench, &stats);
+		report_iteration_result(&stats);
 		report_prefix_pop();
 	}
 
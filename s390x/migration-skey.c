@@ -8,6 +8,9 @@
  * - parallel: start migration and set and check storage keys on some
  *   pages while migration is in process.
  *
+ * With --migrations=N, the VM is migrated N times in a row instead of once,
+ * with a new test pattern for each migration in the sequential variant.
+ *
  * Copyright IBM Corp. 2022
  *
  * Authors:
@@ -46,6 +49,8 @@ static enum {
 	TEST_PARALLEL
 } arg_test_to_run;
 
+static unsigned long arg_migrations = 1;
+
 /*
  * Set storage key test pattern on pagebuf with a seed for the storage keys.
  *
@@ -131,14 +136,22 @@ static void report_verify_result(const struct verify_result * result)
 
 static void test_skey_migration_sequential(void)
 {
+	unsigned long i;
+
 	report_prefix_push("sequential");
 
-	set_test_pattern(0);
+	for (i = 0; i < arg_migrations; i++) {
+		set_test_pattern(i);
 
-	migrate_once();
+		migrate();
 
-	result = verify_test_pattern(0);
-	report_verify_result(&result);
+		if (arg_migrations > 1)
+			report_prefix_pushf("migration %lu", i + 1);
+		result = verify_test_pattern(i);
+		report_verify_result(&result);
+		if (arg_migrations > 1)
+			report_prefix_pop();
+	}
 
 	report_prefix_pop();
 }
@@ -165,6 +178,8 @@ static void set_skeys_thread(void)
 
 static void test_skey_migration_parallel(void)
 {
+	unsigned long i;
+
 	report_prefix_push("parallel");
 
 	if (smp_query_num_cpus() == 1) {
@@ -174,7 +189,8 @@ static void test_skey_migration_parallel(void)
 
 	smp_cpu_setup(1, PSW_WITH_CUR_MASK(set_skeys_thread));
 
-	migrate_once();
+	for (i = 0; i < arg_migrations; i++)
+		migrate();
 
 	WRITE_ONCE(thread_should_exit, 1);
 
@@ -208,22 +224,29 @@ error:
 
 static void print_usage(void)
 {
-	report_info("Usage: migration-skey [--parallel|--sequential]");
+	report_info("Usage: migration-skey [--parallel|--sequential] [--migrations=N]");
 }
 
 static void parse_args(int argc, char **argv)
 {
-	if (argc < 2) {
-		/* default to sequential since it only needs one cpu */
-		arg_test_to_run = TEST_SEQUENTIAL;
-		return;
+	const char *migrations = "--migrations=";
+	int i;
+
+	/* default to sequential since it only needs one cpu */
+	arg_test_to_run = TEST_SEQUENTIAL;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp("--parallel", argv[i]))
+			arg_test_to_run = TEST_PARALLEL;
+		else if (!strcmp("--sequential", argv[i]))
+			arg_test_to_run = TEST_SEQUENTIAL;
+		else if (!strncmp(migrations, argv[i], strlen(migrations)))
+			arg_migrations = atol(argv[i] + strlen(migrations));
+		else
+			break;
 	}
 
-	if (!strcmp("--parallel", argv[1]))
-		arg_test_to_run = TEST_PARALLEL;
-	else if (!strcmp("--sequential", argv[1]))
-		arg_test_to_run = TEST_SEQUENTIAL;
-	else
+	if (i < argc || !arg_migrations)
 		arg_test_to_run = TEST_INVALID;
 }
 
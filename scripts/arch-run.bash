@@ -122,77 +122,163 @@ qmp_events ()
 		jq -c 'select(has("event"))'
 }
 
-run_migration ()
+# Start migrating the VM behind QMP socket $1 to unix socket $2 and set
+# migstatus to its final status as soon as QEMU reports it with a MIGRATION
+# event. Once completed, print the host's view of it as migration number $3.
+# QEMU serves one QMP client at a time, so both go through the same session,
+# which is closed before returning.
+qmp_migrate ()
 {
-	if ! command -v ncat >/dev/null 2>&1; then
-		echo "${FUNCNAME[0]} needs ncat (netcat)" >&2
-		return 77
+	local caps='[ { "capability": "events", "state": true } ]'
+	local line
+
+	migstatus=
+	coproc QMP { exec ncat -U "$1"; }
+	local qmp_in=${QMP[0]} qmp_out=${QMP[1]} qmp_pid=$QMP_PID
+
+	echo '{ "execute": "qmp_capabilities" }' \
+	     '{ "execute": "migrate-set-capabilities", "arguments": { "capabilities": '"$caps"' } }' \
+	     '{ "execute": "migrate", "arguments": { "uri": "unix:'$2'" } }' >&$qmp_out 2>/dev/null
+
+	while [ -z "$migstatus" ] && read -r -u $qmp_in line 2>/dev/null; do
+		migstatus=$(jq -r 'select(.event == "MIGRATION") | .data.status |
+				   select(. == "completed" or . == "failed" or . == "cancelled")' <<<"$line")
+	done
+
+	if [ "$migstatus" = "completed" ]; then
+		echo '{ "execute": "query-migrate" }' >&$qmp_out 2>/dev/null
+		while read -r -u $qmp_in line 2>/dev/null; do
+			line=$(jq -r --arg hop $3 'select(.return.status? == "completed") | .return |
+			    "INFO: migration \($hop): total time \(."total-time") ms, downtime \(.downtime) ms"' <<<"$line")
+			if [ "$line" ]; then
+				echo "$line"
+				break
+			fi
+		done
 	fi
 
-	migsock=$(mktemp -u -t mig-helper-socket.XXXXXXXXXX)
-	migout1=$(mktemp -t mig-helper-stdout1.XXXXXXXXXX)
-	qmp1=$(mktemp -u -t mig-helper-qmp1.XXXXXXXXXX)
-	qmp2=$(mktemp -u -t mig-helper-qmp2.XXXXXXXXXX)
-	fifo=$(mktemp -u -t mig-helper-fifo.XXXXXXXXXX)
-	qmpout1=/dev/null
-	qmpout2=/dev/null
+	kill $qmp_pid 2>/dev/null
+	wait $qmp_pid 2>/dev/null
+}
 
-	trap 'kill 0; exit 2' INT TERM
-	trap 'rm -f ${migout1} ${migsock} ${qmp1} ${qmp2} ${fifo}' RETURN EXIT
+# Start the QEMU that the next migration goes to, with its QMP socket, output
+# file and input FIFO taken from slot $1 of the arrays set up by run_migration.
+migration_incoming ()
+{
+	local slot=$1
+	shift
 
-	eval "$@" -chardev socket,id=mon1,path=${qmp1},server=on,wait=off \
-		-mon chardev=mon1,mode=control | tee ${migout1} &
-	live_pid=`jobs -l %+ | grep "eval" | awk '{print$2}'`
+	rm -f ${migsock} ${qmp[slot]} ${fifo[slot]}
 
 	# We have to use cat to open the named FIFO, because named FIFO's, unlike
 	# pipes, will block on open() until the other end is also opened, and that
 	# totally breaks QEMU...
-	mkfifo ${fifo}
-	eval "$@" -chardev socket,id=mon2,path=${qmp2},server=on,wait=off \
-		-mon chardev=mon2,mode=control -incoming unix:${migsock} < <(cat ${fifo}) &
-	incoming_pid=`jobs -l %+ | awk '{print$2}'`
-
-	# The test must prompt the user to migrate, so wait for the "migrate" keyword
-	while ! grep -q -i "Now migrate the VM" < ${migout1} ; do
-		if ! ps -p ${live_pid} > /dev/null ; then
-			echo "ERROR: Test exit before migration point." >&2
-			echo > ${fifo}
-			qmp ${qmp1} '"quit"'> ${qmpout1} 2>/dev/null
-			qmp ${qmp2} '"quit"'> ${qmpout2} 2>/dev/null
-			return 3
-		fi
-		sleep 1
+	mkfifo ${fifo[slot]}
+	eval "$@" -chardev socket,id=mon,path=${qmp[slot]},server=on,wait=off \
+		-mon chardev=mon,mode=control -incoming unix:${migsock} \
+		< <(cat ${fifo[slot]}) > >(tee ${migout[slot]}) &
+	incoming_pid=$!
+}
+
+# Wait for the incoming QEMU to create socket $1, unless it died already
+migration_incoming_wait ()
+{
+	while ! test -S $1 && kill -0 $incoming_pid 2>/dev/null; do
+		sleep 0.1
 	done
+}
+
+# Wait until the output file $2 of QEMU process $1 asks for a migration.
+# Fail if the process exits without asking, i.e. when the test doesn't
+# migrate anymore.
+migration_wait_prompt ()
+{
+	while kill -0 $1 2>/dev/null; do
+		grep -q -i -m1 "Now migrate the VM" $2 && return 0
+		sleep 0.1
+	done
+	grep -q -i -m1 "Now migrate the VM" $2
+}
 
-	qmp ${qmp1} '"migrate", "arguments": { "uri": "unix:'${migsock}'" }' > ${qmpout1}
+# Migrate the VM every time the test asks for it, ping-ponging between two
+# QEMU instances: once a migration completes, the destination becomes the
+# source and a fresh incoming QEMU is started for the next one.
+run_migration ()
+{
+	local src dst hop=0
+
+	if ! command -v ncat >/dev/null 2>&1; then
+		echo "${FUNCNAME[0]} needs ncat (netcat)" >&2
+		return 77
+	fi
+
+	if ! command -v jq >/dev/null 2>&1; then
+		echo "${FUNCNAME[0]} needs jq" >&2
+		return 77
+	fi
 
-	# Wait for the migration to complete
-	migstatus=`qmp ${qmp1} '"query-migrate"' | grep return`
-	while ! grep -q '"completed"' <<<"$migstatus" ; do
-		sleep 1
-		if ! migstatus=`qmp ${qmp1} '"query-migrate"'`; then
+	migsock=$(mktemp -u -t mig-helper-socket.XXXXXXXXXX)
+	migout=($(mktemp -t mig-helper-stdout1.XXXXXXXXXX)
+		$(mktemp -t mig-helper-stdout2.XXXXXXXXXX))
+	qmp=($(mktemp -u -t mig-helper-qmp1.XXXXXXXXXX)
+	     $(mktemp -u -t mig-helper-qmp2.XXXXXXXXXX))
+	fifo=($(mktemp -u -t mig-helper-fifo1.XXXXXXXXXX)
+	      $(mktemp -u -t mig-helper-fifo2.XXXXXXXXXX))
+
+	trap 'kill 0; exit 2' INT TERM
+	trap 'rm -f ${migsock} ${migout[@]} ${qmp[@]} ${fifo[@]}' RETURN EXIT
+
+	src=0
+	eval "$@" -chardev socket,id=mon,path=${qmp[src]},server=on,wait=off \
+		-mon chardev=mon,mode=control > >(tee ${migout[src]}) &
+	live_pid=$!
+	migration_incoming $((1 - src)) "$@"
+
+	# The test must prompt the user to migrate, so wait for the "migrate"
+	# keyword.
+	while migration_wait_prompt ${live_pid} ${migout[src]}; do
+		dst=$((1 - src))
+
+		migration_incoming_wait ${migsock}
+		qmp_migrate ${qmp[src]} ${migsock} $((hop + 1))
+		if [ -z "$migstatus" ]; then
 			echo "ERROR: Querying migration state failed." >&2
-			echo > ${fifo}
-			qmp ${qmp2} '"quit"'> ${qmpout2} 2>/dev/null
+			echo > ${fifo[dst]}
+			qmp ${qmp[dst]} '"quit"'> /dev/null 2>&1
 			return 2
-		fi
-		migstatus=`grep return <<<"$migstatus"`
-		if grep -q '"failed"' <<<"$migstatus"; then
-			echo "ERROR: Migration failed." >&2
-			echo > ${fifo}
-			qmp ${qmp1} '"quit"'> ${qmpout1} 2>/dev/null
-			qmp ${qmp2} '"quit"'> ${qmpout2} 2>/dev/null
+		elif [ "$migstatus" != "completed" ]; then
+			echo "ERROR: Migration $migstatus." >&2
+			echo > ${fifo[dst]}
+			qmp ${qmp[src]} '"quit"'> /dev/null 2>&1
+			qmp ${qmp[dst]} '"quit"'> /dev/null 2>&1
 			return 2
 		fi
+
+		hop=$((hop + 1))
+		qmp ${qmp[src]} '"quit"'> /dev/null 2>&1
+		wait $live_pid
+		echo > ${fifo[dst]}
+
+		live_pid=$incoming_pid
+		src=$dst
+		migration_incoming $((1 - src)) "$@"
 	done
-	qmp ${qmp1} '"quit"'> ${qmpout1} 2>/dev/null
-	echo > ${fifo}
-	wait $incoming_pid
+
+	wait $live_pid
 	ret=$?
 
-	while (( $(jobs -r | wc -l) > 0 )); do
-		sleep 0.5
-	done
+	# the spare incoming QEMU won't be needed
+	migration_incoming_wait ${qmp[1 - src]}
+	qmp ${qmp[1 - src]} '"quit"'> /dev/null 2>&1
+	echo > ${fifo[1 - src]}
+
+	# let the output watchers finish
+	wait
+
+	if (( hop == 0 )); then
+		echo "ERROR: Test exit before migration point." >&2
+		return 3
+	fi
 
 	return $ret
 }
@@ -73,6 +73,7 @@ generate_test ()
 	echo "exec {stdout}>&1"
 	echo "RUNTIME_log_stdout () { cat >&\$stdout; }"
 	echo "RUNTIME_log_stderr () { cat >&2; }"
+	echo "RUNTIME_log_duration () { :; }"
 
 	cat scripts/runtime.bash
 
@@ -12,14 +12,59 @@ extract_summary()
     tail -3 | grep '^SUMMARY: ' | sed 's/^SUMMARY: /(/;s/'"$cr"'\{0,1\}$/)/'
 }
 
-# We assume that QEMU is going to work if it tried to load the kernel
+# Hash stdin for the probe cache with md5sum, BSD's md5 or POSIX cksum,
+# whichever is there. Prints nothing if none is.
+probe_hash()
+{
+    if command -v md5sum >/dev/null; then
+        md5sum
+    elif command -v md5 >/dev/null; then
+        md5 -q
+    elif command -v cksum >/dev/null; then
+        cksum | { read -r crc size; echo "$crc-$size"; }
+    fi
+}
+
+# We assume that QEMU is going to work if it tried to load the kernel.
+# The outcome only depends on how QEMU is configured, so if
+# RUNTIME_probe_cache names a directory, it is kept there and tests with
+# the same configuration don't start QEMU again just to probe it.
 premature_failure()
 {
-    local log="$(eval "$(get_cmdline _NO_FILE_4Uhere_)" 2>&1)"
+    local cache log args key i
+
+    if [ -n "$RUNTIME_probe_cache" ]; then
+        # the test's name, time limit and -append arguments don't matter
+        eval "args=($opts)"
+        key="ACCEL=$accel $RUNTIME_arch_run -smp $smp"
+        for (( i = 0; i < ${#args[@]}; i++ )); do
+            if [ "${args[i]}" = "-append" ]; then
+                (( i++ ))
+            else
+                key+=" ${args[i]}"
+            fi
+        done
+        cache=$(probe_hash <<< "$key")
+        cache=${cache:+$RUNTIME_probe_cache/${cache%% *}}
+    fi
 
-    echo "$log" | grep "_NO_FILE_4Uhere_" |
-        grep -q -e "could not \(load\|open\) kernel" -e "error loading" &&
+    if [ -n "$cache" ] && [ -f $cache.ok ]; then
         return 1
+    elif [ -n "$cache" ] && [ -f $cache.log ]; then
+        log="$(< $cache.log)"
+    else
+        log="$(eval "$(get_cmdline _NO_FILE_4Uhere_)" 2>&1)"
+
+        if echo "$log" | grep "_NO_FILE_4Uhere_" |
+                grep -q -e "could not \(load\|open\) kernel" -e "error loading"; then
+            [ -n "$cache" ] && touch $cache.ok
+            return 1
+        fi
+
+        # write atomically, parallel tests may be reading it
+        [ -n "$cache" ] && echo "$log" > $cache.$BASHPID &&
+            mv $cache.$BASHPID $cache.log
+    fi
 
     RUNTIME_log_stderr <<< "$log"
 
@@ -70,6 +115,22 @@ function find_word()
     grep -Fq " $1 " <<< " $2 "
 }
 
+# Milliseconds since the epoch. date +%N is GNU only, so use bash 5's
+# EPOCHREALTIME if there, and fall back to whole seconds otherwise.
+function now_ms()
+{
+    local t
+
+    if [ -n "$EPOCHREALTIME" ]; then
+        t=${EPOCHREALTIME/[.,]/}
+        echo $((t / 1000))
+    elif t=$(date +%s%3N 2>/dev/null) && [[ $t =~ ^[0-9]+$ ]]; then
+        echo $t
+    else
+        echo $(($(date +%s) * 1000))
+    fi
+}
+
 function run()
 {
     local testname="$1"
@@ -168,9 +229,11 @@ function run()
     # extra_params in the config file may contain backticks that need to be
     # expanded, so use eval to start qemu.  Use "> >(foo)" instead of a pipe to
     # preserve the exit status.
+    local start=$(now_ms)
     summary=$(eval "$cmdline" 2> >(RUNTIME_log_stderr $testname) \
                              > >(tee >(RUNTIME_log_stdout $testname $kernel) | extract_summary))
     ret=$?
+    RUNTIME_log_duration $testname $(( $(now_ms) - start ))
     [ "$KUT_STANDALONE" != "yes" ] && echo > >(RUNTIME_log_stdout $testname $kernel)
 
     if [ $ret -eq 0 ]; then
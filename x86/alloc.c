@@ -0,0 +1,402 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Allocator tests
+ *
+ * Per-CPU page cache: a page freed on a CPU is the next one it gets back,
+ * no page ever has two owners while all vCPUs allocate and free at once,
+ * and pages left in the cache of a CPU are not lost to the others when
+ * memory runs out.
+ *
+ * vmalloc slabs: objects of each size class are aligned to it and do not
+ * overlap, a freed object is the next one allocated, and free() tells
+ * slab objects from bigger allocations, releasing only the latter's pages.
+ *
+ * Bulk allocations: alloc_pages_bulk() carves the biggest blocks it can,
+ * free_pages_bulk() gives every page back, and vmalloc allocations that
+ * are mapped VM_BULK pages at a time are whole and freed across batches.
+ *
+ * Block mappings: big vmalloc and vmap() ranges are mapped with large
+ * pages, which virt_to_pte_phys() resolves to the right address.
+ */
+#include "libcflat.h"
+#include "alloc.h"
+#include "alloc_page.h"
+#include "smp.h"
+#include "vm.h"
+#include "vmalloc.h"
+
+#define PAGES_PER_CPU	256
+#define ROUNDS		16
+
+/* The vmalloc size classes, and enough objects to fill several slabs */
+#define SLAB_MIN_SIZE	16
+#define SLAB_MAX_SIZE	1024
+#define SLAB_OBJECTS	256
+
+/* Pages vmalloc maps or frees at once, VM_BULK in lib/vmalloc.c */
+#define VM_BULK		32
+/* 64 + 32 + 4 pages */
+#define BULK_PAGES	100
+
+/* Blocks up to 4M, the large pages of i386 without PAE */
+#define BLOCK_MAX_ORDER	10
+
+static int nr_corrupted;
+static unsigned long nr_pages;
+static unsigned char *objs[SLAB_OBJECTS];
+static void *bulk[BULK_PAGES + 1];
+static phys_addr_t bulk_phys[2 * VM_BULK + 1];
+
+static void test_page_reuse(void)
+{
+	void *p, *q;
+
+	p = alloc_page();
+	free_page(p);
+	q = alloc_page();
+	report(p && p == q, "page cache: freed page is reused first");
+	free_page(q);
+}
+
+/* Pages are linked through their first word, the rest holds the owner. */
+static unsigned long *alloc_owned_pages(unsigned long n, unsigned long owner)
+{
+	unsigned long *page, *list = NULL;
+	int i;
+
+	while (n--) {
+		page = alloc_page();
+		if (!page)
+			break;
+		for (i = 1; i < PAGE_SIZE / sizeof(long); i++)
+			page[i] = owner;
+		page[0] = (unsigned long)list;
+		list = page;
+	}
+	return list;
+}
+
+/* Returns the number of pages freed. */
+static unsigned long free_owned_pages(unsigned long *list, unsigned long owner)
+{
+	unsigned long *page, n = 0;
+	int i;
+
+	while (list) {
+		page = list;
+		list = (unsigned long *)page[0];
+		for (i = 1; i < PAGE_SIZE / sizeof(long); i++) {
+			if (page[i] != owner) {
+				__sync_fetch_and_add(&nr_corrupted, 1);
+				break;
+			}
+		}
+		free_page(page);
+		n++;
+	}
+	return n;
+}
+
+static void alloc_free_pages(void *data)
+{
+	unsigned long id = smp_id();
+	int r;
+
+	for (r = 0; r < ROUNDS; r++)
+		free_owned_pages(alloc_owned_pages(PAGES_PER_CPU, id), id);
+}
+
+static void alloc_free_all_pages(void *data)
+{
+	unsigned long id = smp_id();
+
+	nr_pages = free_owned_pages(alloc_owned_pages(-1ul, id), id);
+}
+
+static void test_page_cache(void)
+{
+	unsigned long nr_pages0;
+
+	test_page_reuse();
+
+	nr_corrupted = 0;
+	on_cpus(alloc_free_pages, NULL);
+	report(!nr_corrupted, "page cache: %d vcpus allocating and freeing at once",
+	       cpu_count());
+
+	if (cpu_count() < 2) {
+		report_skip("page cache: need at least 2 cpus to share pages");
+		return;
+	}
+	/* What CPU 0 frees stays in its cache, CPU 1 must get it anyway. */
+	alloc_free_all_pages(NULL);
+	nr_pages0 = nr_pages;
+	on_cpu(1, alloc_free_all_pages, NULL);
+	report(nr_pages0 && nr_pages == nr_pages0 && !nr_corrupted,
+	       "page cache: cpu 1 gets all %lu pages after cpu 0 freed them",
+	       nr_pages0);
+	page_alloc_print_stats();
+}
+
+/* Allocate objects of size @size and just above half of it, in turn. */
+static void test_slab_class(size_t size)
+{
+	size_t len;
+	bool ok = true;
+	int i, j;
+
+	for (i = 0; i < SLAB_OBJECTS; i++) {
+		len = i & 1 ? size / 2 + 1 : size;
+		objs[i] = malloc(len);
+		if (!objs[i] || !IS_ALIGNED((uintptr_t)objs[i], size) ||
+		    IS_ALIGNED((uintptr_t)objs[i], PAGE_SIZE)) {
+			ok = false;
+			break;
+		}
+		memset(objs[i], i, len);
+	}
+	while (i--) {
+		len = i & 1 ? size / 2 + 1 : size;
+		for (j = 0; j < len; j++)
+			ok = ok && objs[i][j] == (unsigned char)i;
+		free(objs[i]);
+	}
+	report(ok, "slab: %zu byte objects", size);
+}
+
+static void test_slab_reuse(void)
+{
+	void *p, *q;
+	bool ok = true;
+	size_t size;
+
+	for (size = SLAB_MIN_SIZE; size <= SLAB_MAX_SIZE; size *= 2) {
+		p = malloc(size);
+		free(p);
+		q = malloc(size);
+		ok = ok && p && p == q;
+		free(q);
+	}
+	report(ok, "slab: freed objects are reused first");
+}
+
+static phys_addr_t page_phys(void *virt)
+{
+	return virt_to_pte_phys(current_page_table(), virt) & PAGE_MASK;
+}
+
+/*
+ * Freed pages are the next ones the page allocator gives out, so check
+ * which page comes next after each free().
+ */
+static void test_free_large(void)
+{
+	phys_addr_t phys;
+	char *p, *q;
+	void *page;
+
+	p = malloc(SLAB_MAX_SIZE);
+	q = malloc(SLAB_MAX_SIZE);
+	memset(q, 0x5a, SLAB_MAX_SIZE);
+	phys = page_phys(p);
+	free(p);
+	page = alloc_page();
+	report(page && virt_to_phys(page) != phys && q[0] == 0x5a,
+	       "free: slab object keeps its page");
+	free_page(page);
+	free(q);
+
+	p = malloc(SLAB_MAX_SIZE + 1);
+	phys = page_phys(p);
+	free(p);
+	page = alloc_page();
+	report(page && virt_to_phys(page) == phys, "free: single page object releases its page");
+	free_page(page);
+
+	/* the metadata page, right before the object, is freed last */
+	p = malloc(3 * PAGE_SIZE);
+	phys = page_phys(p - PAGE_SIZE);
+	report(IS_ALIGNED((uintptr_t)p, PAGE_SIZE), "malloc: multi-page object is page aligned");
+	free(p);
+	page = alloc_page();
+	report(page && virt_to_phys(page) == phys, "free: multi-page object releases its pages");
+	free_page(page);
+}
+
+static void test_slabs(void)
+{
+	size_t size;
+
+	for (size = SLAB_MIN_SIZE; size <= SLAB_MAX_SIZE; size *= 2)
+		test_slab_class(size);
+	test_slab_reuse();
+	test_free_large();
+}
+
+static unsigned long count_free_pages(void)
+{
+	unsigned long id = smp_id();
+
+	return free_owned_pages(alloc_owned_pages(-1ul, id), id);
+}
+
+/* Whether the page at @phys is free, found out by reserving it. */
+static bool page_is_free(phys_addr_t phys)
+{
+	if (reserve_pages(phys, 1))
+		return false;
+	unreserve_pages(phys, 1);
+	return true;
+}
+
+/* Whether the @n pages from @i on form one naturally aligned block. */
+static bool is_block(int i, int n)
+{
+	phys_addr_t phys = virt_to_phys(bulk[i]);
+	int j;
+
+	if (!IS_ALIGNED(phys, n * PAGE_SIZE))
+		return false;
+	for (j = 1; j < n; j++)
+		if (virt_to_phys(bulk[i + j]) != phys + j * PAGE_SIZE)
+			return false;
+	return true;
+}
+
+static void test_bulk_pages(void)
+{
+	unsigned long nr_free = count_free_pages();
+	bool zeroed = true;
+	size_t n;
+	int i, j;
+
+	n = alloc_pages_bulk(bulk, BULK_PAGES, AREA_ANY);
+	report(n == BULK_PAGES, "bulk: %zu of %d pages allocated", n, BULK_PAGES);
+	if (n != BULK_PAGES) {
+		free_pages_bulk(bulk, n);
+		return;
+	}
+	report(is_block(0, 64) && is_block(64, 32) && is_block(96, 4),
+	       "bulk: pages split into blocks of 64, 32 and 4");
+	for (i = 0; i < BULK_PAGES; i++)
+		for (j = 0; j < PAGE_SIZE / sizeof(long); j++)
+			zeroed = zeroed && !((unsigned long *)bulk[i])[j];
+	report(zeroed, "bulk: pages are zeroed");
+	report(count_free_pages() == nr_free - BULK_PAGES, "bulk: %d pages taken",
+	       BULK_PAGES);
+
+	/* NULL entries are skipped */
+	bulk[BULK_PAGES] = NULL;
+	free_pages_bulk(bulk, BULK_PAGES + 1);
+	report(count_free_pages() == nr_free, "bulk: %d pages given back", BULK_PAGES);
+}
+
+static void test_vmalloc_batches(void)
+{
+	static const int sizes[] = { VM_BULK - 1, VM_BULK, VM_BULK + 1, 2 * VM_BULK + 1 };
+	bool mapped, freed;
+	phys_addr_t meta;
+	char *p;
+	int i, j, k;
+
+	for (k = 0; k < ARRAY_SIZE(sizes); k++) {
+		p = malloc(sizes[k] * PAGE_SIZE);
+		mapped = !!p;
+		for (i = 0; mapped && i < sizes[k]; i++) {
+			bulk_phys[i] = page_phys(p + i * PAGE_SIZE);
+			mapped = bulk_phys[i];
+			for (j = 0; j < i; j++)
+				mapped = mapped && bulk_phys[j] != bulk_phys[i];
+			memset(p + i * PAGE_SIZE, i, PAGE_SIZE);
+		}
+		for (i = 0; mapped && i < sizes[k]; i++)
+			mapped = p[i * PAGE_SIZE] == (char)i &&
+				 p[i * PAGE_SIZE + PAGE_SIZE - 1] == (char)i;
+		report(mapped, "vmalloc: %d pages mapped to distinct pages", sizes[k]);
+		if (!mapped)
+			continue;
+
+		meta = page_phys(p - PAGE_SIZE);
+		free(p);
+		freed = page_is_free(meta);
+		for (i = 0; i < sizes[k]; i++)
+			freed = freed && page_is_free(bulk_phys[i]);
+		report(freed, "vmalloc: %d pages freed", sizes[k]);
+	}
+}
+
+static void test_bulk(void)
+{
+	test_bulk_pages();
+	test_vmalloc_batches();
+}
+
+/*
+ * Whether @virt starts a large page of @order, through which writes land
+ * where virt_to_pte_phys() says.
+ */
+static bool is_block_mapped(char *virt, unsigned int order)
+{
+	size_t offsets[] = { 0, PAGE_SIZE + 8, (PAGE_SIZE << order) - 8 };
+	pgd_t *cr3 = current_page_table();
+	struct pte_search search = find_pte_level(cr3, virt, 1);
+	phys_addr_t phys = virt_to_pte_phys(cr3, virt);
+	unsigned long *v;
+	int i;
+
+	if (!found_huge_pte(search) || search.level != order / PGDIR_WIDTH + 1)
+		return false;
+	for (i = 0; i < ARRAY_SIZE(offsets); i++) {
+		v = (unsigned long *)(virt + offsets[i]);
+		*v = (unsigned long)v;
+		if (virt_to_pte_phys(cr3, v) != phys + offsets[i] ||
+		    *(unsigned long *)phys_to_virt(phys + offsets[i]) != (unsigned long)v)
+			return false;
+	}
+	return true;
+}
+
+static void test_block_mappings(void)
+{
+	unsigned int order = vm_block_order(BLOCK_MAX_ORDER);
+	size_t block = PAGE_SIZE << order;
+	struct pte_search search;
+	phys_addr_t phys;
+	char *p, *tail;
+	void *pages;
+
+	if (!order) {
+		report_skip("vmalloc: no block mappings");
+		return;
+	}
+
+	/* two blocks, then pages mapped VM_BULK at a time */
+	p = malloc(2 * block + (VM_BULK + 1) * PAGE_SIZE);
+	assert(p);
+	report(IS_ALIGNED((uintptr_t)p, block), "vmalloc: aligned to order %u blocks", order);
+	report(is_block_mapped(p, order) && is_block_mapped(p + block, order),
+	       "vmalloc: order %u blocks mapped and resolved", order);
+	tail = p + 2 * block + VM_BULK * PAGE_SIZE + 8;
+	search = find_pte_level(current_page_table(), tail, 1);
+	report(search.level == 1 && page_phys(tail) == (*search.pte & PT_ADDR_MASK),
+	       "vmalloc: pages after the blocks mapped and resolved");
+	phys = page_phys(p);
+	free(p);
+	report(page_is_free(phys), "vmalloc: blocks freed");
+
+	pages = alloc_pages(order);
+	assert(pages);
+	p = vmap(virt_to_phys(pages), block);
+	report(is_block_mapped(p, order), "vmap: order %u block mapped and resolved", order);
+	free_pages(pages);
+}
+
+int main(void)
+{
+	setup_vm();
+	test_page_cache();
+	test_slabs();
+	test_bulk();
+	test_block_mappings();
+	return report_summary();
+}
@@ -4,14 +4,19 @@
 #include "libcflat.h"
 #include "processor.h"
 
+#define HYPERV_CPUID_VENDOR_AND_MAX_FUNCTIONS   0x40000000
 #define HYPERV_CPUID_FEATURES                   0x40000003
+#define HYPERV_CPUID_ENLIGHTMENT_INFO           0x40000004
 
 #define HV_X64_MSR_TIME_REF_COUNT_AVAILABLE     (1 << 1)
 #define HV_X64_MSR_SYNIC_AVAILABLE              (1 << 2)
 #define HV_X64_MSR_SYNTIMER_AVAILABLE           (1 << 3)
 
+#define HV_X64_REMOTE_TLB_FLUSH_RECOMMENDED     (1 << 2)
+
 #define HV_X64_MSR_GUEST_OS_ID                  0x40000000
 #define HV_X64_MSR_HYPERCALL                    0x40000001
+#define HV_X64_MSR_VP_INDEX                     0x40000002
 
 #define HV_X64_MSR_TIME_REF_COUNT               0x40000020
 #define HV_X64_MSR_REFERENCE_TSC                0x40000021
@@ -172,9 +177,24 @@ struct hv_event_flags_page {
 
 #define HV_HYPERCALL_FAST               (1u << 16)
 
+#define HVCALL_FLUSH_VIRTUAL_ADDRESS_SPACE      0x0002
+#define HVCALL_FLUSH_VIRTUAL_ADDRESS_LIST       0x0003
 #define HVCALL_POST_MESSAGE                     0x5c
 #define HVCALL_SIGNAL_EVENT                     0x5d
 
+#define HV_HYPERCALL_RESULT_MASK        0xffff
+
+#define HV_FLUSH_ALL_PROCESSORS                 (1ull << 0)
+#define HV_FLUSH_ALL_VIRTUAL_ADDRESS_SPACES     (1ull << 1)
+#define HV_FLUSH_NON_GLOBAL_MAPPINGS_ONLY       (1ull << 2)
+
+struct hv_tlb_flush {
+	u64 address_space;
+	u64 flags;
+	u64 processor_mask;
+	u64 gva_list[];
+};
+
 struct hv_input_post_message {
 	u32 connectionid;
 	u32 reserved;
@@ -198,6 +218,26 @@ static inline bool hv_time_ref_counter_supported(void)
     return cpuid(HYPERV_CPUID_FEATURES).a & HV_X64_MSR_TIME_REF_COUNT_AVAILABLE;
 }
 
+/* The enlightenments below only mean anything if this is true. */
+static inline bool hv_present(void)
+{
+	struct cpuid c = raw_cpuid(HYPERV_CPUID_VENDOR_AND_MAX_FUNCTIONS, 0);
+	u32 sig[4] = { c.b, c.c, c.d };
+
+	return !strcmp((char *)sig, "Microsoft Hv");
+}
+
+static inline bool hv_remote_tlb_flush_recommended(void)
+{
+	return hv_present() &&
+	       raw_cpuid(HYPERV_CPUID_VENDOR_AND_MAX_FUNCTIONS, 0).a >= HYPERV_CPUID_ENLIGHTMENT_INFO &&
+	       (cpuid(HYPERV_CPUID_ENLIGHTMENT_INFO).a & HV_X64_REMOTE_TLB_FLUSH_RECOMMENDED);
+}
+
+void setup_hypercall(void);
+void teardown_hypercall(void);
+u64 do_hypercall(u16 code, u64 arg, bool fast);
+
 void synic_sint_create(u8 sint, u8 vec, bool auto_eoi);
 void synic_sint_set(u8 vcpu, u8 sint);
 void synic_sint_destroy(u8 sint);
@@ -0,0 +1,382 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Measure IPI latency between every pair of vCPUs, and IPI throughput with
+ * all of them sending to each other
+ *
+ * vmexit's ipi tests only measure CPU 0 to CPU 1, which hides what crossing
+ * SMT siblings, cores and NUMA nodes on the host costs. Here, for every
+ * sender/receiver pair in turn, the sender flags a request and IPIs the
+ * halted receiver, whose handler timestamps it and IPIs the sender back:
+ *   + one-way latency is the receiver's timestamp minus the sender's, which
+ *     relies on the TSCs being synchronized,
+ *   + the round trip lasts until the sender has taken the reply.
+ * Then all vCPUs ping each other round-robin at once, which gives the
+ * aggregate throughput and the round trip of every pair under load.
+ * Latencies are printed as sender x receiver matrices.
+ *
+ * Usage: ipi-matrix [iters=<N>] [rounds=<N>] [cpus=<N>]
+ *   iters   round trips per pair, the median is reported, default 256
+ *   rounds  all-to-all round trips from each vCPU to each other one,
+ *           default 64
+ *   cpus    only use the first N vCPUs, default all
+ */
+#include "libcflat.h"
+#include "alloc.h"
+#include "bench.h"
+#include "bitops.h"
+#include "smp.h"
+#include "util.h"
+#include "x86/apic.h"
+#include "x86/isr.h"
+#include "x86/processor.h"
+#include "asm/barrier.h"
+
+#define IPI_TEST_VECTOR	0xb0
+
+enum cmd {
+	CMD_NONE,
+	CMD_PING,	/* ping ->target iters times */
+	CMD_FLOOD,	/* ping everyone, rounds times */
+	CMD_EXIT,
+};
+
+struct pcpu {
+	u32 apic_id;
+	int cmd;
+	int target;
+	/* Set by the receiver of our ping, which then IPIs us. */
+	uint64_t stamp;
+	int acked;
+	/* Set by our own handler once it has seen acked. */
+	int done;
+} __attribute__((aligned(64)));
+
+static struct pcpu *pcpus;
+static int nr_cpus, me0;
+/* nr_cpus rows of pending requests, one bit per sender */
+static unsigned long *requests;
+static int nr_words;
+
+static long iters = 256, rounds = 64;
+static uint64_t *rtt_samples, *one_way_samples;
+static unsigned long skewed;
+
+/* Per sender row, only written by the sender. */
+static uint64_t *flood_ticks, *flood_count;
+static int flood_ready, flood_go;
+
+static uint64_t tsc_read(void)
+{
+	return rdtsc();
+}
+
+static const struct bench_clock tsc_clock = {
+	.unit = "cycles",
+	.read = tsc_read,
+};
+
+/*
+ * With the xAPIC the ICR takes two writes, which the handler must not
+ * interleave with.
+ */
+static void send_ipi(int cpu)
+{
+	unsigned long flags = read_rflags();
+
+	cli();
+	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED |
+		       IPI_TEST_VECTOR, pcpus[cpu].apic_id);
+	write_rflags(flags);
+}
+
+static void ipi_isr(isr_regs_t *regs)
+{
+	uint64_t now = rdtsc();
+	int me = smp_index();
+	unsigned long *req = &requests[me * nr_words], bits;
+	int w, sender;
+
+	for (w = 0; w < nr_words; w++) {
+		bits = __sync_fetch_and_and(&req[w], 0);
+		while (bits) {
+			sender = w * BITS_PER_LONG + __builtin_ctzl(bits);
+			bits &= bits - 1;
+			pcpus[sender].stamp = now;
+			smp_wmb();
+			WRITE_ONCE(pcpus[sender].acked, 1);
+			send_ipi(sender);
+		}
+	}
+
+	if (READ_ONCE(pcpus[me].acked)) {
+		pcpus[me].acked = 0;
+		WRITE_ONCE(pcpus[me].done, 1);
+	}
+
+	eoi();
+}
+
+/* Returns the round trip; interrupts must be enabled. */
+static uint64_t ping(int me, int target, uint64_t *one_way)
+{
+	struct pcpu *p = &pcpus[me];
+	unsigned long tries = 1ul << 30;
+	uint64_t start, end;
+
+	p->done = 0;
+	start = rdtsc();
+	__sync_fetch_and_or(&requests[target * nr_words + BIT_WORD(me)], BIT_MASK(me));
+	send_ipi(target);
+	while (!READ_ONCE(p->done) && --tries)
+		pause();
+	end = rdtsc();
+	assert_msg(tries, "cpu%d: no reply from cpu%d", me, target);
+
+	if (one_way) {
+		smp_rmb();
+		if ((int64_t)(p->stamp - start) < 0) {
+			skewed++;
+			*one_way = 0;
+		} else {
+			*one_way = p->stamp - start;
+		}
+	}
+	return end - start;
+}
+
+static void do_ping(int me)
+{
+	int target = pcpus[me].target;
+	long i;
+
+	for (i = 0; i < iters; i++)
+		rtt_samples[i] = ping(me, target, &one_way_samples[i]);
+}
+
+static void do_flood(int me)
+{
+	uint64_t *ticks = &flood_ticks[me * nr_cpus];
+	uint64_t *count = &flood_count[me * nr_cpus];
+	int target, r, k;
+
+	__sync_fetch_and_add(&flood_ready, 1);
+	while (!READ_ONCE(flood_go))
+		pause();
+
+	for (r = 0; r < rounds; r++) {
+		for (k = 1; k < nr_cpus; k++) {
+			target = (me + k) % nr_cpus;
+			ticks[target] += ping(me, target, NULL);
+			count[target]++;
+		}
+	}
+}
+
+/* Halt until @cpu has nothing to do, so that we can be IPI'd meanwhile. */
+static void wait_cmd_done(int cpu)
+{
+	cli();
+	while (READ_ONCE(pcpus[cpu].cmd) != CMD_NONE) {
+		safe_halt();
+		cli();
+	}
+	sti();
+}
+
+static void worker(void *data)
+{
+	int me = smp_index();
+	struct pcpu *p = &pcpus[me];
+	int cmd;
+
+	for (;;) {
+		cli();
+		while ((cmd = READ_ONCE(p->cmd)) == CMD_NONE) {
+			safe_halt();
+			cli();
+		}
+		sti();
+
+		if (cmd == CMD_EXIT)
+			break;
+		if (cmd == CMD_PING)
+			do_ping(me);
+		else
+			do_flood(me);
+
+		smp_wmb();
+		WRITE_ONCE(p->cmd, CMD_NONE);
+		send_ipi(me0);
+	}
+
+	WRITE_ONCE(p->cmd, CMD_NONE);
+	send_ipi(me0);
+	cli();
+}
+
+static void post_cmd(int cpu, int cmd)
+{
+	WRITE_ONCE(pcpus[cpu].cmd, cmd);
+	send_ipi(cpu);
+}
+
+static void measure_pairs(void)
+{
+	uint64_t *rtt = calloc(nr_cpus * nr_cpus, sizeof(*rtt));
+	uint64_t *one_way = calloc(nr_cpus * nr_cpus, sizeof(*one_way));
+	struct bench_stats stats;
+	int s, r;
+	long i;
+
+	assert(rtt && one_way);
+
+	for (s = 0; s < nr_cpus; s++) {
+		for (r = 0; r < nr_cpus; r++) {
+			if (s == r) {
+				rtt[s * nr_cpus + r] = one_way[s * nr_cpus + r] = BENCH_NONE;
+				continue;
+			}
+
+			pcpus[s].target = r;
+			if (s == me0) {
+				do_ping(s);
+			} else {
+				post_cmd(s, CMD_PING);
+				wait_cmd_done(s);
+			}
+			smp_rmb();
+
+			for (i = 0; i < iters; i++) {
+				rtt_samples[i] = bench_scale(&tsc_clock, rtt_samples[i], 1);
+				one_way_samples[i] = bench_scale(&tsc_clock, one_way_samples[i], 1);
+			}
+			bench_reduce(rtt_samples, iters, false, &stats);
+			rtt[s * nr_cpus + r] = stats.median;
+			bench_reduce(one_way_samples, iters, false, &stats);
+			one_way[s * nr_cpus + r] = stats.median;
+		}
+	}
+
+	bench_matrix_print(&tsc_clock, "one-way latency, median", one_way, nr_cpus);
+	bench_matrix_print(&tsc_clock, "round trip, median", rtt, nr_cpus);
+	if (skewed)
+		report_info("%lu one-way samples went back in time, TSCs not synchronized?",
+			    skewed);
+
+	free(rtt);
+	free(one_way);
+}
+
+static void measure_flood(void)
+{
+	uint64_t *rtt = calloc(nr_cpus * nr_cpus, sizeof(*rtt));
+	uint64_t start, ticks, total = 0;
+	int cpu, i;
+
+	assert(rtt);
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (cpu != me0)
+			post_cmd(cpu, CMD_FLOOD);
+	}
+	while (READ_ONCE(flood_ready) < nr_cpus - 1)
+		pause();
+
+	start = rdtsc();
+	WRITE_ONCE(flood_go, 1);
+	do_flood(me0);
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		wait_cmd_done(cpu);
+	ticks = rdtsc() - start;
+	smp_rmb();
+
+	for (i = 0; i < nr_cpus * nr_cpus; i++) {
+		total += flood_count[i];
+		rtt[i] = flood_count[i] ?
+			 bench_scale(&tsc_clock, flood_ticks[i], flood_count[i]) : BENCH_NONE;
+	}
+
+	bench_matrix_print(&tsc_clock, "round trip under all-to-all load, mean", rtt, nr_cpus);
+	printf("all-to-all: %" PRIu64 " round trips in %" PRIu64 " cycles, %" PRIu64
+	       " per Mcycle\n", total, ticks, ticks ? total * 1000000 / ticks : 0);
+	report(total == (uint64_t)nr_cpus * (nr_cpus - 1) * rounds,
+	       "all-to-all: every vCPU pinged every other one %ld times", rounds);
+
+	free(rtt);
+}
+
+static void parse_args(int argc, char **argv)
+{
+	long val;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (parse_keyval(argv[i], &val) < 0)
+			report_abort("unknown argument %s", argv[i]);
+
+		if (!strncmp(argv[i], "iters=", 6))
+			iters = val;
+		else if (!strncmp(argv[i], "rounds=", 7))
+			rounds = val;
+		else if (!strncmp(argv[i], "cpus=", 5))
+			nr_cpus = MIN(val, nr_cpus);
+		else
+			report_abort("unknown argument %s", argv[i]);
+	}
+
+	if (iters <= 0 || rounds <= 0 || nr_cpus <= 0)
+		report_abort("invalid arguments");
+}
+
+int main(int argc, char **argv)
+{
+	int cpu;
+
+	report_prefix_push("ipi-matrix");
+	nr_cpus = cpu_count();
+	parse_args(argc, argv);
+
+	if (nr_cpus < 2) {
+		report_skip("need at least 2 cpus");
+		goto out;
+	}
+
+	nr_words = (nr_cpus + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	pcpus = memalign(64, nr_cpus * sizeof(*pcpus));
+	requests = calloc(nr_cpus * nr_words, sizeof(*requests));
+	rtt_samples = malloc(iters * sizeof(*rtt_samples));
+	one_way_samples = malloc(iters * sizeof(*one_way_samples));
+	flood_ticks = calloc(nr_cpus * nr_cpus, sizeof(*flood_ticks));
+	flood_count = calloc(nr_cpus * nr_cpus, sizeof(*flood_count));
+	assert(pcpus && requests && rtt_samples && one_way_samples &&
+	       flood_ticks && flood_count);
+
+	memset(pcpus, 0, nr_cpus * sizeof(*pcpus));
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		pcpus[cpu].apic_id = id_map[cpu];
+	me0 = smp_index();
+	assert(me0 < nr_cpus);
+
+	handle_irq(IPI_TEST_VECTOR, ipi_isr);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (cpu != me0)
+			on_cpu_async(cpu, worker, NULL);
+	}
+	sti();
+
+	report_info("%d vcpus, %ld round trips per pair", nr_cpus, iters);
+	measure_pairs();
+	measure_flood();
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (cpu != me0) {
+			post_cmd(cpu, CMD_EXIT);
+			wait_cmd_done(cpu);
+		}
+	}
+	cli();
+
+out:
+	report_prefix_pop();
+	return report_summary();
+}
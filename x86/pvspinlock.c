@@ -0,0 +1,437 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Test and measure halting in a contended lock and being kicked awake
+ *
+ * A queued (MCS) lock hands itself from each holder to the next waiter in
+ * line. Waiters spin for a while, then, depending on the mode:
+ *   spin  keep spinning,
+ *   ipi   halt with interrupts enabled and are woken by an IPI,
+ *   pv    halt with interrupts disabled and are woken by KVM_HC_KICK_CPU,
+ *         like Linux's paravirtual spinlocks.
+ * A waiter advertises that it halts before checking one last time whether
+ * it got the lock, and the holder hands the lock over before checking
+ * whether the waiter halted, so one of them always sees the other. With PV
+ * kicks this relies on a kick that arrives before the HLT not being lost,
+ * which is tested first on its own.
+ *
+ * While the other vCPUs hammer the lock, the BSP checks that they make
+ * progress: a halted waiter that already owns the lock means a lost
+ * wake-up. Mutual exclusion is checked with a counter only the holder
+ * increments. The handoff latency is from the release to the next waiter
+ * owning the lock, and only meaningful with synchronized TSCs.
+ *
+ * To measure the overcommitted case, run with more vCPUs than host CPUs,
+ * or pin the vCPUs to fewer host CPUs.
+ *
+ * Usage: pvspinlock [iters=<N>] [cs=<cycles>] [ncs=<cycles>] [spin=<N>]
+ *   iters  acquisitions per vCPU, default 100000
+ *   cs     cycles spent in the critical section, default 200
+ *   ncs    cycles spent outside of it, default 1000
+ *   spin   pause iterations before halting, default 1000
+ */
+#include "libcflat.h"
+#include "alloc.h"
+#include "bench.h"
+#include "smp.h"
+#include "util.h"
+#include "asm/barrier.h"
+#include "x86/apic.h"
+#include "x86/isr.h"
+#include "x86/kvm_para.h"
+#include "x86/processor.h"
+
+#define KICK_VECTOR	0xb0
+
+/* Both are full barriers, unlike __sync_lock_test_and_set(). */
+#define xchg(ptr, val)		__atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define cmpxchg(ptr, old, new)	__sync_val_compare_and_swap(ptr, old, new)
+
+/* Declare a lost wake-up after this many cycles without progress. */
+#define STALL_CYCLES	(1ull << 34)
+
+enum mode {
+	MODE_SPIN,
+	MODE_IPI,
+	MODE_PV,
+	NR_MODES
+};
+
+static const char * const mode_names[NR_MODES] = {
+	"spin", "ipi", "pv",
+};
+
+enum {
+	VCPU_RUNNING,
+	VCPU_HALTED,
+};
+
+struct qnode {
+	struct qnode *next;
+	int locked;
+	int state;
+	u32 apic_id;
+	uint64_t released;		/* TSC when the lock was handed to us */
+} __attribute__((aligned(64)));
+
+struct qlock {
+	struct qnode *tail;
+};
+
+struct vcpu_stats {
+	unsigned long acquired;
+	unsigned long halts;
+	unsigned long spurious;		/* woken without owning the lock */
+	unsigned long kicks;
+	struct bench_hist handoff;
+} __attribute__((aligned(64)));
+
+static struct qlock lock;
+static struct qnode *nodes;
+static struct vcpu_stats *stats;
+static int nr_cpus, mode;
+static volatile unsigned long shared_count;
+static int nr_started, nr_done;
+
+static long iters = 100000, cs_cycles = 200, ncs_cycles = 1000, spin = 1000;
+
+static void kick_isr(isr_regs_t *regs)
+{
+	eoi();
+}
+
+static void delay_cycles(uint64_t cycles)
+{
+	uint64_t end = rdtsc() + cycles;
+
+	while (rdtsc() < end)
+		pause();
+}
+
+static void kick(struct qnode *node)
+{
+	if (mode == MODE_PV)
+		kvm_kick_cpu(node->apic_id);
+	else
+		apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED |
+			       KICK_VECTOR, node->apic_id);
+}
+
+static void halt(void)
+{
+	/* With interrupts disabled only a kick gets us out of HLT. */
+	if (mode == MODE_PV) {
+		asm volatile("hlt");
+	} else {
+		safe_halt();
+		cli();
+	}
+}
+
+static void wait_for_lock(struct qnode *node, struct vcpu_stats *st)
+{
+	long i;
+
+	for (;;) {
+		for (i = 0; i < spin; i++) {
+			if (READ_ONCE(node->locked))
+				return;
+			pause();
+		}
+		if (mode == MODE_SPIN)
+			continue;
+
+		xchg(&node->state, VCPU_HALTED);
+		if (READ_ONCE(node->locked)) {
+			WRITE_ONCE(node->state, VCPU_RUNNING);
+			return;
+		}
+		halt();
+		st->halts++;
+		if (!READ_ONCE(node->locked)) {
+			st->spurious++;
+			WRITE_ONCE(node->state, VCPU_RUNNING);
+		}
+	}
+}
+
+static void qlock_acquire(struct qnode *node, struct vcpu_stats *st)
+{
+	struct qnode *prev;
+
+	node->next = NULL;
+	node->locked = 0;
+	node->state = VCPU_RUNNING;
+
+	prev = xchg(&lock.tail, node);
+	if (!prev)
+		return;
+
+	WRITE_ONCE(prev->next, node);
+	wait_for_lock(node, st);
+	bench_hist_add(&st->handoff, rdtsc() - node->released);
+}
+
+static void qlock_release(struct qnode *node, struct vcpu_stats *st)
+{
+	struct qnode *next = READ_ONCE(node->next);
+
+	if (!next) {
+		if (cmpxchg(&lock.tail, node, NULL) == node)
+			return;
+		while (!(next = READ_ONCE(node->next)))
+			pause();
+	}
+
+	next->released = rdtsc();
+	smp_wmb();
+	WRITE_ONCE(next->locked, 1);
+	if (mode != MODE_SPIN && xchg(&next->state, VCPU_RUNNING) == VCPU_HALTED) {
+		kick(next);
+		st->kicks++;
+	}
+}
+
+static void hammer(void *data)
+{
+	int me = smp_index();
+	struct qnode *node = &nodes[me];
+	struct vcpu_stats *st = &stats[me];
+	long i;
+
+	__sync_fetch_and_add(&nr_started, 1);
+	while (READ_ONCE(nr_started) < nr_cpus - 1)
+		pause();
+
+	for (i = 0; i < iters; i++) {
+		qlock_acquire(node, st);
+		shared_count = shared_count + 1;
+		delay_cycles(cs_cycles);
+		qlock_release(node, st);
+		WRITE_ONCE(st->acquired, st->acquired + 1);
+		delay_cycles(ncs_cycles);
+	}
+
+	__sync_fetch_and_add(&nr_done, 1);
+}
+
+static unsigned long total_acquired(void)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		sum += READ_ONCE(stats[cpu].acquired);
+	return sum;
+}
+
+/* Returns false if the vCPUs stopped making progress. */
+static bool watch_progress(void)
+{
+	unsigned long seen = 0, now;
+	uint64_t last = rdtsc();
+	bool stalled = false;
+	int cpu;
+
+	while (READ_ONCE(nr_done) < nr_cpus - 1) {
+		now = total_acquired();
+		if (now != seen) {
+			seen = now;
+			last = rdtsc();
+		} else if (rdtsc() - last > STALL_CYCLES) {
+			stalled = true;
+			break;
+		}
+		pause();
+	}
+
+	if (!stalled)
+		return true;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (READ_ONCE(nodes[cpu].state) == VCPU_HALTED &&
+		    READ_ONCE(nodes[cpu].locked))
+			report_info("cpu%d halted while owning the lock", cpu);
+	}
+	return false;
+}
+
+static void run_mode(int m, int bsp)
+{
+	unsigned long halts = 0, spurious = 0, kicks = 0, expected;
+	struct bench_hist *handoff = malloc(sizeof(*handoff));
+	uint64_t start, cycles;
+	bool progress;
+	int cpu;
+
+	assert(handoff);
+	mode = m;
+	lock.tail = NULL;
+	shared_count = 0;
+	nr_started = nr_done = 0;
+	memset(stats, 0, nr_cpus * sizeof(*stats));
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		bench_hist_init(&stats[cpu].handoff);
+	smp_wmb();
+
+	start = rdtsc();
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (cpu != bsp)
+			on_cpu_async(cpu, hammer, NULL);
+	}
+	progress = watch_progress();
+	cycles = rdtsc() - start;
+
+	report(progress, "%s: no lost wake-ups", mode_names[m]);
+	if (!progress)
+		report_abort("%s: vCPUs are stuck", mode_names[m]);
+
+	smp_rmb();
+	bench_hist_init(handoff);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		halts += stats[cpu].halts;
+		spurious += stats[cpu].spurious;
+		kicks += stats[cpu].kicks;
+		bench_hist_merge(handoff, &stats[cpu].handoff);
+	}
+
+	expected = (nr_cpus - 1) * iters;
+	report(shared_count == expected, "%s: mutual exclusion", mode_names[m]);
+	printf("%s: %lu acquisitions in %" PRIu64 " Mcycles, %" PRIu64
+	       " per Mcycle, %lu halts, %lu spurious wake-ups, %lu kicks\n",
+	       mode_names[m], expected, cycles / 1000000,
+	       cycles ? (uint64_t)expected * 1000000 / cycles : 0,
+	       halts, spurious, kicks);
+	bench_hist_print("handoff cycles", handoff);
+	free(handoff);
+}
+
+static int halted_flag, started_flag, woke_flag, go_flag;
+
+static void halt_until_kicked(void *data)
+{
+	WRITE_ONCE(halted_flag, 1);
+	asm volatile("hlt");
+	WRITE_ONCE(woke_flag, 1);
+}
+
+static void halt_after_kick(void *data)
+{
+	WRITE_ONCE(started_flag, 1);
+	while (!READ_ONCE(go_flag))
+		pause();
+	asm volatile("hlt");
+	WRITE_ONCE(woke_flag, 1);
+}
+
+static bool wait_woke(void)
+{
+	uint64_t start = rdtsc();
+
+	while (!READ_ONCE(woke_flag)) {
+		if (rdtsc() - start > STALL_CYCLES)
+			return false;
+		pause();
+	}
+	return true;
+}
+
+/*
+ * The target runs with interrupts disabled, see on_cpu_async(), so only a
+ * kick can get it out of HLT.
+ */
+static void test_kick(int target)
+{
+	u32 apic_id = nodes[target].apic_id;
+
+	halted_flag = woke_flag = 0;
+	on_cpu_async(target, halt_until_kicked, NULL);
+	while (!READ_ONCE(halted_flag))
+		pause();
+	delay_cycles(10000000);
+	report(!READ_ONCE(woke_flag), "vCPU halted with interrupts disabled stays halted");
+	report(!kvm_kick_cpu(apic_id), "KVM_HC_KICK_CPU succeeds");
+	if (!wait_woke())
+		report_abort("kick didn't wake up a halted vCPU");
+	report_pass("kick wakes up a halted vCPU");
+
+	/*
+	 * Kick only once the target runs halt_after_kick(), lest the kick
+	 * complete the idle HLT that on_cpu_async() wakes it up from.
+	 */
+	started_flag = woke_flag = go_flag = 0;
+	on_cpu_async(target, halt_after_kick, NULL);
+	while (!READ_ONCE(started_flag))
+		pause();
+	kvm_kick_cpu(apic_id);
+	WRITE_ONCE(go_flag, 1);
+	if (!wait_woke())
+		report_abort("kick before HLT was lost");
+	report_pass("kick before HLT is not lost");
+}
+
+static void parse_args(int argc, char **argv)
+{
+	long val;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (parse_keyval(argv[i], &val) < 0)
+			report_abort("unknown argument %s", argv[i]);
+
+		if (!strncmp(argv[i], "iters=", 6))
+			iters = val;
+		else if (!strncmp(argv[i], "cs=", 3))
+			cs_cycles = val;
+		else if (!strncmp(argv[i], "ncs=", 4))
+			ncs_cycles = val;
+		else if (!strncmp(argv[i], "spin=", 5))
+			spin = val;
+		else
+			report_abort("unknown argument %s", argv[i]);
+	}
+
+	if (iters <= 0 || cs_cycles < 0 || ncs_cycles < 0 || spin < 0)
+		report_abort("invalid arguments");
+}
+
+int main(int argc, char **argv)
+{
+	bool pv_unhalt = kvm_para_has_feature(KVM_FEATURE_PV_UNHALT);
+	int cpu, bsp, m;
+
+	report_prefix_push("pvspinlock");
+	parse_args(argc, argv);
+	nr_cpus = cpu_count();
+
+	if (nr_cpus < 3) {
+		report_skip("need at least 3 cpus, 2 to contend and 1 to watch");
+		goto out;
+	}
+
+	nodes = memalign(64, nr_cpus * sizeof(*nodes));
+	stats = memalign(64, nr_cpus * sizeof(*stats));
+	assert(nodes && stats);
+	memset(nodes, 0, nr_cpus * sizeof(*nodes));
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		nodes[cpu].apic_id = id_map[cpu];
+	bsp = smp_index();
+	handle_irq(KICK_VECTOR, kick_isr);
+
+	report_info("%d vcpus contending, %ld acquisitions each, cs %ld ncs %ld cycles",
+		    nr_cpus - 1, iters, cs_cycles, ncs_cycles);
+
+	if (pv_unhalt)
+		test_kick(bsp ? 0 : 1);
+
+	for (m = 0; m < NR_MODES; m++) {
+		if (m == MODE_PV && !pv_unhalt) {
+			report_skip("pv: no KVM_FEATURE_PV_UNHALT, try -cpu ...,kvm-pv-unhalt=on");
+			continue;
+		}
+		run_mode(m, bsp);
+	}
+
+out:
+	report_prefix_pop();
+	return report_summary();
+}
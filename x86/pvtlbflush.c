@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Test and measure remote TLB flushes: IPIs vs KVM's and Hyper-V's
+ * paravirtual flushes vs broadcast invalidation
+ *
+ * One page of virtual address space is remapped round after round, from
+ * one physical page to another and then to nothing. The vCPU doing it
+ * flushes its own TLB with INVLPG and the other ones', which cached the
+ * old translation, in one of these ways:
+ *   ipi     an IPI to each of them, whose handler does INVLPG,
+ *   pv      the same, except for vCPUs whose steal time area says they are
+ *           preempted: those get KVM_VCPU_FLUSH_TLB set instead and KVM
+ *           flushes their TLB before they run again,
+ *   hyperv  HvCallFlushVirtualAddressSpace, KVM kicks the vCPUs and
+ *           returns once they have all left guest mode,
+ *   invlpgb INVLPGB then TLBSYNC, which invalidate on all of them without
+ *           interrupting anyone, where the CPU has them.
+ * Then every vCPU reads the page and must see the new mapping, or fault
+ * if it is gone. The latency is from the start of the remote flush until
+ * it is known to have completed, for 2, 4, ... all vCPUs, along with the
+ * flushes per Mcycle that makes for one vCPU. The pv flush only
+ * differs from IPIs with vCPUs actually preempted on the host, run with
+ * more vCPUs than host CPUs to see it.
+ *
+ * Usage: pvtlbflush [rounds=<N>]
+ *   rounds  flushes for each mode and vCPU count, default 1000
+ */
+#include "libcflat.h"
+#include "alloc.h"
+#include "alloc_page.h"
+#include "bench.h"
+#include "smp.h"
+#include "tlbflush.h"
+#include "vmalloc.h"
+#include "asm/barrier.h"
+#include "x86/apic.h"
+#include "x86/desc.h"
+#include "x86/isr.h"
+#include "x86/kvm_para.h"
+#include "x86/processor.h"
+#include "x86/vm.h"
+#include "hyperv.h"
+
+#define FLUSH_VECTOR	0xb0
+
+enum mode {
+	MODE_IPI,
+	MODE_PV,
+	MODE_HV,
+	MODE_INVLPGB,
+	NR_MODES
+};
+
+static const char * const mode_names[NR_MODES] = {
+	"ipi", "pv", "hyperv", "invlpgb",
+};
+
+/* What the test page maps in turn. */
+#define NR_STATES	3
+#define STATE_UNMAPPED	2
+
+struct pcpu {
+	u32 apic_id;
+	u32 vp_index;
+} __attribute__((aligned(64)));
+
+static struct pcpu *pcpus;
+static struct kvm_steal_time *steal_time;
+static int nr_cpus, me0;
+static bool has_pv, has_hv;
+
+static unsigned long *test_va;
+static phys_addr_t test_pa[2];
+static const unsigned long markers[2] = { 0x11111111, 0x22222222 };
+static int state;
+
+static int nr_flushed;
+static unsigned long deferred, total_deferred;
+static struct hv_tlb_flush *hv_flush;
+
+static uint64_t tsc_read(void)
+{
+	return rdtsc();
+}
+
+static const struct bench_clock tsc_clock = {
+	.unit = "cycles",
+	.read = tsc_read,
+};
+
+static void flush_isr(isr_regs_t *regs)
+{
+	invlpg(test_va);
+	__sync_fetch_and_add(&nr_flushed, 1);
+	eoi();
+}
+
+static void local_flush(void)
+{
+	invlpg(test_va);
+}
+
+static void check_mapping(void)
+{
+	unsigned long val = 0;
+	unsigned int vector;
+
+	vector = asm_safe_out1("mov (%[va]), %[val]", [val] "=r"(val),
+			       [va] "r"(test_va));
+
+	if (state == STATE_UNMAPPED ? vector != PF_VECTOR :
+	    vector || val != markers[state])
+		tlbflush_stale();
+}
+
+static void worker(void *data)
+{
+	int me = smp_index();
+
+	if (has_pv)
+		wrmsr(MSR_KVM_STEAL_TIME,
+		      virt_to_phys(&steal_time[me]) | KVM_MSR_ENABLED);
+	if (has_hv)
+		pcpus[me].vp_index = rdmsr(HV_X64_MSR_VP_INDEX);
+
+	/* Spin rather than halt: only running vCPUs get preempted. */
+	sti();
+	tlbflush_serve(me);
+	cli();
+
+	if (has_pv)
+		wrmsr(MSR_KVM_STEAL_TIME, 0);
+	tlbflush_ack();
+}
+
+static void remap(void)
+{
+	pteval_t pte = 0;
+
+	state = (state + 1) % NR_STATES;
+	if (state != STATE_UNMAPPED)
+		pte = test_pa[state] | PT_PRESENT_MASK | PT_WRITABLE_MASK;
+	install_pte(current_page_table(), 1, test_va, pte, NULL);
+	invlpg(test_va);
+}
+
+static void send_flush_ipi(int cpu)
+{
+	apic_icr_write(APIC_INT_ASSERT | APIC_DEST_PHYSICAL | APIC_DM_FIXED |
+		       FLUSH_VECTOR, pcpus[cpu].apic_id);
+}
+
+/* Like Linux's kvm_flush_tlb_multi(). Returns how many IPIs it sent. */
+static int flush_pv(void)
+{
+	struct kvm_steal_time *st;
+	int cpu, sent = 0;
+	u8 preempted;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (cpu == me0 || !tlbflush_is_active(cpu))
+			continue;
+
+		st = &steal_time[cpu];
+		preempted = READ_ONCE(st->preempted);
+		if ((preempted & KVM_VCPU_PREEMPTED) &&
+		    __sync_bool_compare_and_swap(&st->preempted, preempted,
+						 preempted | KVM_VCPU_FLUSH_TLB)) {
+			deferred++;
+			continue;
+		}
+		send_flush_ipi(cpu);
+		sent++;
+	}
+	return sent;
+}
+
+static bool flush_hv(void)
+{
+	u64 status;
+	int cpu;
+
+	hv_flush->address_space = 0;
+	hv_flush->flags = HV_FLUSH_ALL_VIRTUAL_ADDRESS_SPACES;
+	hv_flush->processor_mask = 0;
+	if (tlbflush_nr_active == nr_cpus) {
+		hv_flush->flags |= HV_FLUSH_ALL_PROCESSORS;
+	} else {
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (cpu != me0 && tlbflush_is_active(cpu))
+				hv_flush->processor_mask |= 1ull << pcpus[cpu].vp_index;
+		}
+	}
+
+	status = do_hypercall(HVCALL_FLUSH_VIRTUAL_ADDRESS_SPACE,
+			      virt_to_phys(hv_flush), false);
+	return !(status & HV_HYPERCALL_RESULT_MASK);
+}
+
+/* Returns the latency of the remote flush. */
+static uint64_t flush_remote(int m)
+{
+	uint64_t start, end;
+	int cpu, sent = 0;
+
+	nr_flushed = 0;
+	start = rdtsc();
+	switch (m) {
+	case MODE_IPI:
+		for (cpu = 0; cpu < nr_cpus; cpu++) {
+			if (cpu != me0 && tlbflush_is_active(cpu)) {
+				send_flush_ipi(cpu);
+				sent++;
+			}
+		}
+		break;
+	case MODE_PV:
+		sent = flush_pv();
+		break;
+	case MODE_HV:
+		if (!flush_hv())
+			report_abort("HvCallFlushVirtualAddressSpace failed");
+		break;
+	case MODE_INVLPGB:
+		/* Reaches the inactive vCPUs as well. */
+		invlpgb((unsigned long)test_va | INVLPGB_VA, 0, 0);
+		tlbsync();
+		break;
+	}
+	while (READ_ONCE(nr_flushed) < sent)
+		pause();
+	end = rdtsc();
+
+	return end - start;
+}
+
+static bool hv_mask_fits(void)
+{
+	int cpu;
+
+	if (tlbflush_nr_active == nr_cpus)
+		return true;
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (tlbflush_is_active(cpu) && pcpus[cpu].vp_index >= 64)
+			return false;
+	}
+	return true;
+}
+
+static bool prep_mode(int m)
+{
+	if (m == MODE_HV && !hv_mask_fits()) {
+		report_info("hyperv/%d: VP indexes don't fit in a mask, skipped",
+			    tlbflush_nr_active);
+		return false;
+	}
+	deferred = 0;
+	return true;
+}
+
+static void print_mode(int m, const char *name)
+{
+	if (m != MODE_PV)
+		return;
+	printf("  %s: %lu of %lu remote flushes deferred to preempted vCPUs\n",
+	       name, deferred, tlbflush_rounds * (tlbflush_nr_active - 1));
+	total_deferred += deferred;
+}
+
+static const struct tlbflush_ops ops = {
+	.clock = &tsc_clock,
+	.mode_names = mode_names,
+	.local_flush = local_flush,
+	.check = check_mapping,
+	.remap = remap,
+	.flush = flush_remote,
+	.prep = prep_mode,
+	.print = print_mode,
+};
+
+int main(int argc, char **argv)
+{
+	unsigned long *page;
+	int cpu, i, m, order;
+
+	report_prefix_push("pvtlbflush");
+	tlbflush_parse_args(argc, argv);
+	setup_vm();
+	nr_cpus = cpu_count();
+
+	if (nr_cpus < 2) {
+		report_skip("need at least 2 cpus");
+		goto out;
+	}
+
+	has_pv = kvm_para_has_feature(KVM_FEATURE_STEAL_TIME) &&
+		 kvm_para_has_feature(KVM_FEATURE_PV_TLB_FLUSH);
+	has_hv = hv_remote_tlb_flush_recommended();
+
+	pcpus = memalign(64, nr_cpus * sizeof(*pcpus));
+	/* The host takes a GPA, so not vmalloc'ed memory. */
+	order = get_order(PAGE_ALIGN(nr_cpus * sizeof(*steal_time)) >> PAGE_SHIFT);
+	steal_time = alloc_pages(order);
+	assert(pcpus && steal_time);
+	memset(pcpus, 0, nr_cpus * sizeof(*pcpus));
+	memset(steal_time, 0, nr_cpus * sizeof(*steal_time));
+	for (cpu = 0; cpu < nr_cpus; cpu++)
+		pcpus[cpu].apic_id = id_map[cpu];
+	me0 = smp_index();
+	tlbflush_init(&ops, nr_cpus, me0);
+
+	for (i = 0; i < 2; i++) {
+		page = alloc_page();
+		assert(page);
+		page[0] = markers[i];
+		test_pa[i] = virt_to_phys(page);
+	}
+	test_va = alloc_vpage();
+	install_pte(current_page_table(), 1, test_va,
+		    test_pa[0] | PT_PRESENT_MASK | PT_WRITABLE_MASK, NULL);
+
+	if (has_hv) {
+		setup_hypercall();
+		hv_flush = alloc_page();
+		assert(hv_flush);
+		pcpus[me0].vp_index = rdmsr(HV_X64_MSR_VP_INDEX);
+	}
+
+	handle_irq(FLUSH_VECTOR, flush_isr);
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		if (cpu != me0)
+			on_cpu_async(cpu, worker, NULL);
+	}
+	tlbflush_wait_ready();
+
+	report_info("%d vcpus, %ld flushes per mode and vcpu count", nr_cpus,
+		    tlbflush_rounds);
+	bench_print_header(&tsc_clock);
+	for (m = 0; m < NR_MODES; m++) {
+		if (m == MODE_PV && !has_pv) {
+			report_skip("pv: no KVM_FEATURE_PV_TLB_FLUSH, try -cpu ...,kvm-pv-tlb-flush=on");
+			continue;
+		}
+		if (m == MODE_HV && !has_hv) {
+			report_skip("hyperv: remote TLB flush not recommended, try -cpu ...,hv-vpindex,hv-tlbflush");
+			continue;
+		}
+		if (m == MODE_INVLPGB && !this_cpu_has(X86_FEATURE_INVLPGB)) {
+			report_skip("invlpgb: not supported");
+			continue;
+		}
+		tlbflush_run_mode(m);
+		if (m == MODE_PV && !total_deferred)
+			report_info("pv: no vCPU was preempted, nothing to defer");
+	}
+
+	tlbflush_exit();
+	if (has_hv) {
+		free_page(hv_flush);
+		teardown_hypercall();
+	}
+
+out:
+	report_prefix_pop();
+	return report_summary();
+}
@@ -1,4 +1,6 @@
 #include "libcflat.h"
+#include "alloc.h"
+#include "bench.h"
 #include "acpi.h"
 #include "smp.h"
 #include "pci.h"
@@ -20,6 +22,11 @@ struct test {
 #define GOAL (1ull << 30)
 
 static int nr_cpus;
+/* CPUs that run parallel tests, less than nr_cpus while sweeping. */
+static int nr_active;
+static bool sweep;
+/* Also time every iteration of a second pass, for the latency histogram. */
+static bool hist;
 static u64 cr4_shadow;
 
 static void cpuid_test(void)
@@ -251,11 +258,49 @@ static void ple_round_robin(void)
 
 	p->n2 = p->n1;
 	you = me + 1;
-	if (you == nr_cpus)
+	if (you == nr_active)
 		you = 0;
 	++counters[you].n1;
 }
 
+/*
+ * Lock holder preemption: a ticket lock around a few shared cache lines.
+ * With more vCPUs than host CPUs, the waiters queued behind a descheduled
+ * holder spin in PAUSE until PLE kicks in and, hopefully, yields to it.
+ * With "hist", the histogram's tail is the worst-case wait.
+ */
+static struct {
+	unsigned int next;
+	unsigned int owner;
+} ple_ticket __attribute__((aligned(64)));
+static struct {
+	unsigned long n;
+} __attribute__((aligned(64))) ple_lock_data[4];
+static int ple_lock_holder = -1;
+static unsigned long ple_lock_broken;
+
+static void ple_lock(void)
+{
+	unsigned int ticket = __sync_fetch_and_add(&ple_ticket.next, 1);
+	int me = smp_id(), i;
+
+	while (READ_ONCE(ple_ticket.owner) != ticket)
+		pause();
+	barrier();
+
+	if (READ_ONCE(ple_lock_holder) != -1)
+		++ple_lock_broken;
+	WRITE_ONCE(ple_lock_holder, me);
+	for (i = 0; i < ARRAY_SIZE(ple_lock_data); ++i)
+		++ple_lock_data[i].n;
+	if (READ_ONCE(ple_lock_holder) != me)
+		++ple_lock_broken;
+	WRITE_ONCE(ple_lock_holder, -1);
+
+	barrier();
+	WRITE_ONCE(ple_ticket.owner, ticket + 1);
+}
+
 static void rd_tsc_adjust_msr(void)
 {
 	rdmsr(MSR_IA32_TSC_ADJUST);
@@ -505,6 +550,7 @@ static struct test tests[] = {
 	{ ipi, "ipi", is_smp, .parallel = 0, },
 	{ ipi_halt, "ipi_halt", is_smp, .parallel = 0, },
 	{ ple_round_robin, "ple_round_robin", .parallel = 1 },
+	{ ple_lock, "ple_lock", .parallel = 1 },
 	{ wr_kernel_gs_base, "wr_kernel_gs_base", .parallel = 1 },
 	{ wr_tsx_ctrl_msr, "wr_tsx_ctrl_msr", has_tsx_ctrl, .parallel = 1, },
 	{ wr_ibrs_msr, "wr_ibrs_msr", has_spec_ctrl, .parallel = 1 },
@@ -518,6 +564,7 @@ static struct test tests[] = {
 };
 
 unsigned iterations;
+static unsigned long total_iterations;
 
 static void run_test(void *_func)
 {
@@ -528,13 +575,143 @@ static void run_test(void *_func)
         func();
 }
 
-static bool do_test(struct test *test)
+/* on_cpus() restricted to the first nr_active CPUs. */
+static void on_active_cpus(void (*func)(void *data), void *data)
+{
+	int cpu;
+
+	for (cpu = nr_active - 1; cpu >= 0; --cpu)
+		on_cpu_async(cpu, func, data);
+
+	while (cpus_active() > 1)
+		pause();
+}
+
+static void vmexit_run(struct bench *bench, unsigned long iters)
+{
+	struct test *test = bench->data;
+	unsigned long i;
+
+	total_iterations += iters;
+	if (!test->parallel) {
+		for (i = 0; i < iters; ++i)
+			test->func();
+	} else {
+		iterations = iters;
+		on_active_cpus(run_test, test->func);
+	}
+}
+
+static struct bench_hist *hists;
+static uint64_t rdtsc_overhead;
+
+/*
+ * Time every single iteration so that bimodal exit paths and host
+ * preemption show up in the tail instead of vanishing into the mean.
+ */
+static void sample_test(void *data)
+{
+	struct test *test = data;
+	struct bench_hist *hist;
+	uint64_t t1, t2;
+	int i, id = smp_id();
+
+	assert(id < nr_cpus);
+	hist = &hists[id];
+	for (i = 0; i < iterations; ++i) {
+		t1 = rdtsc();
+		test->func();
+		t2 = rdtsc();
+		t2 -= t1;
+		bench_hist_add(hist, t2 > rdtsc_overhead ? t2 - rdtsc_overhead : 0);
+	}
+}
+
+static void sample_hist(struct test *test, unsigned long iters)
 {
 	int i;
-	unsigned long long t1, t2;
-        void (*func)(void);
 
-        iterations = 32;
+	for (i = 0; i < nr_cpus; ++i)
+		bench_hist_init(&hists[i]);
+
+	total_iterations += iters;
+	iterations = iters;
+	if (!test->parallel)
+		sample_test(test);
+	else
+		on_active_cpus(sample_test, test);
+
+	for (i = 1; i < nr_cpus; ++i)
+		bench_hist_merge(&hists[0], &hists[i]);
+	bench_hist_print(test->name, &hists[0]);
+}
+
+static void measure_rdtsc_overhead(void)
+{
+	uint64_t t1, t2;
+	int i;
+
+	rdtsc_overhead = ~0ull;
+	for (i = 0; i < 1000; ++i) {
+		t1 = rdtsc();
+		t2 = rdtsc();
+		rdtsc_overhead = MIN(rdtsc_overhead, t2 - t1);
+	}
+	printf("rdtsc overhead %" PRIu64 " cycles (subtracted from histograms)\n",
+	       rdtsc_overhead);
+}
+
+static uint64_t tsc_read(void)
+{
+	return rdtsc();
+}
+
+static const struct bench_clock tsc_clock = {
+	.unit = "cycles",
+	.read = tsc_read,
+};
+
+static const struct bench_params params = {
+	.warmup = 2,
+	.reps = 32,
+	.target = GOAL / 32,
+};
+
+/*
+ * Run a parallel test on 1, 2, 4, ... nr_cpus CPUs. The per-iteration
+ * value is the cost seen by each vCPU, the aggregate throughput is the
+ * number of iterations completed by all active vCPUs per million cycles.
+ */
+static void sweep_test(struct test *test, struct bench *bench)
+{
+	struct bench_stats stats;
+	char name[64];
+	int n = 1;
+
+	for (;;) {
+		nr_active = n;
+		bench_measure(&tsc_clock, &params, bench, &stats);
+		snprintf(name, sizeof(name), "%s/%d", test->name, n);
+		bench_print(name, &stats);
+		printf("  sweep %s vcpus %d per_vcpu %" PRIu64
+		       " aggregate_per_mcycle %" PRIu64 "\n", test->name, n,
+		       stats.median / BENCH_SCALE,
+		       stats.median ? (uint64_t)n * 1000000 * BENCH_SCALE / stats.median : 0);
+		if (n == nr_cpus)
+			break;
+		n = MIN(n * 2, nr_cpus);
+	}
+	nr_active = nr_cpus;
+}
+
+static bool do_test(struct test *test)
+{
+	struct bench bench = {
+		.name = test->name,
+		.run = vmexit_run,
+		.data = test,
+	};
+	struct bench_stats stats;
 
         if (test->valid && !test->valid()) {
 		printf("%s (skipped)\n", test->name);
@@ -545,30 +722,29 @@ static bool do_test(struct test *test)
 		return false;
 	}
 
-	func = test->func;
-        if (!func) {
+        if (!test->func) {
 		printf("%s (skipped)\n", test->name);
 		return false;
 	}
 
-	do {
-		tsc_eoi = tsc_ipi = 0;
-		iterations *= 2;
-		t1 = rdtsc();
+	tsc_eoi = tsc_ipi = 0;
+	total_iterations = 0;
+	if (sweep && test->parallel) {
+		sweep_test(test, &bench);
+		return test->next;
+	}
 
-		if (!test->parallel) {
-			for (i = 0; i < iterations; ++i)
-				func();
-		} else {
-			on_cpus(run_test, func);
-		}
-		t2 = rdtsc();
-	} while ((t2 - t1) < GOAL);
-	printf("%s %d\n", test->name, (int)((t2 - t1) / iterations));
+	bench_measure(&tsc_clock, &params, &bench, &stats);
+	bench_print(test->name, &stats);
+	if (test->parallel && stats.median)
+		printf("  aggregate %s vcpus %d per_mcycle %" PRIu64 "\n", test->name,
+		       nr_active, (uint64_t)nr_active * 1000000 * BENCH_SCALE / stats.median);
+	if (hist)
+		sample_hist(test, stats.iters * params.reps);
 	if (tsc_ipi)
-		printf("  ipi %s %d\n", test->name, (int)(tsc_ipi / iterations));
+		printf("  ipi %s %d\n", test->name, (int)(tsc_ipi / total_iterations));
 	if (tsc_eoi)
-		printf("  eoi %s %d\n", test->name, (int)(tsc_eoi / iterations));
+		printf("  eoi %s %d\n", test->name, (int)(tsc_eoi / total_iterations));
 
 	return test->next;
 }
@@ -593,9 +769,48 @@ static bool test_wanted(struct test *test, char *wanted[], int nwanted)
 	return false;
 }
 
+static int run_tests(int ac, char **av)
+{
+	int i, j;
+
+	/*
+	 * "sweep" selects the vCPU scaling mode, "hist" the latency
+	 * histograms, other arguments are tests.
+	 */
+	sweep = hist = false;
+	for (i = j = 1; i < ac; ++i) {
+		if (!strcmp(av[i], "sweep"))
+			sweep = true;
+		else if (!strcmp(av[i], "hist"))
+			hist = true;
+		else
+			av[j++] = av[i];
+	}
+	ac = j;
+
+	/* a batch runs this once per test, ple_lock_data counts acquisitions */
+	ple_lock_broken = 0;
+	memset(ple_lock_data, 0, sizeof(ple_lock_data));
+
+	if (hist)
+		measure_rdtsc_overhead();
+	bench_print_header(&tsc_clock);
+	for (i = 0; i < ARRAY_SIZE(tests); ++i)
+		if (test_wanted(&tests[i], av + 1, ac - 1))
+			while (do_test(&tests[i])) {}
+
+	if (ple_lock_data[0].n) {
+		if (ple_lock_broken)
+			report_info("ple_lock: %lu violations in %lu acquisitions",
+				    ple_lock_broken, ple_lock_data[0].n);
+		report(!ple_lock_broken, "ple_lock: mutual exclusion");
+		return report_summary();
+	}
+	return 0;
+}
+
 int main(int ac, char **av)
 {
-	int i;
 	unsigned long membar = 0;
 	struct pci_dev pcidev;
 	int ret;
@@ -604,6 +819,9 @@ int main(int ac, char **av)
 	cr4_shadow = read_cr4();
 	handle_irq(IPI_TEST_VECTOR, self_ipi_isr);
 	nr_cpus = cpu_count();
+	nr_active = nr_cpus;
+	hists = malloc(nr_cpus * sizeof(*hists));
+	assert(hists);
 
 	sti();
 	on_cpus(enable_nx, NULL);
@@ -620,9 +838,5 @@ int main(int ac, char **av)
 		       pcidev.bdf, membar, pci_test.iobar);
 	}
 
-	for (i = 0; i < ARRAY_SIZE(tests); ++i)
-		if (test_wanted(&tests[i], av + 1, ac - 1))
-			while (do_test(&tests[i])) {}
-
-	return 0;
+	return report_batch(ac, av, run_tests);
 }